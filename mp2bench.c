@@ -0,0 +1,572 @@
+/*
+ * Per-stage benchmark of the mpeg audio layer 2 encoder
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Times psy_analyze(), filter(), idct32(), compute_scale_factors(),
+ * compute_bit_allocation() and encode_frame() separately for mono and
+ * stereo, every sample rate and a few bitrates, on synthetic signals.
+ * The kernels are the ones MPA_encode_init() selects, which the
+ * MP2EN_KERNELS environment variable can force.
+ *
+ * With -q, encodes the signals, plus a treble one, with each allocation
+ * table and in the variable rate modes instead, decodes them with
+ * mp2dec.c and prints the encoding speed next to the signal to noise
+ * ratio and the noise to mask ratio of each subband. The subbands
+ * of the input and of the coding noise come from a reference analysis
+ * filter bank in double precision, the mask from psycho acoustic model 1
+ * whatever the model of the encoder: NMR = SMR - SNR, in dB, so the noise
+ * is masked below 0.
+ *
+ * usage: mp2bench [-q] [frames per run] [psycho acoustic model]
+ */
+
+#include <math.h>
+#include <time.h>
+
+/* the stages are static functions of the encoder */
+#include "mp2en.c"
+#include "mp2dec.h"
+
+#define BENCH_DEFAULT_FRAMES 200
+
+enum {
+    STAGE_PSY,
+    STAGE_FILTER,
+    STAGE_IDCT,
+    STAGE_SCALE,
+    STAGE_ALLOC,
+    STAGE_ENCODE,
+    STAGE_NB
+};
+
+static const char * const stage_names[STAGE_NB] = {
+    "psy", "filter", "idct32", "scale", "alloc", "encode",
+};
+
+enum {
+    SIGNAL_SILENCE,
+    SIGNAL_TONE,
+    SIGNAL_NOISE,
+    SIGNAL_TRANSIENT,
+    SIGNAL_TREBLE,
+    SIGNAL_NB
+};
+
+static const char * const signal_names[SIGNAL_NB] = {
+    "silence", "tone", "noise", "transient", "treble",
+};
+
+static const int bench_rates[6] = { 44100, 48000, 32000, 22050, 24000, 16000 };
+
+/* low, medium and high bitrate in kb/s per [lsf][channels - 1] */
+static const int bench_bitrates[2][2][3] = {
+    { {  64,  96, 192 }, { 128, 192, 384 } },
+    { {  32,  64, 160 }, {  64,  96, 160 } },
+};
+
+static int64_t bench_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t bench_rand(uint32_t *state)
+{
+    *state = *state * 1664525 + 1013904223;
+    return *state;
+}
+
+static void make_signal(int16_t *samples, int nb_samples, int channels,
+                        int sample_rate, int signal)
+{
+    uint32_t state = 1;
+    int i, ch;
+
+    for(i=0;i<nb_samples;i++) {
+        for(ch=0;ch<channels;ch++) {
+            double t = (double)i / sample_rate;
+            int v;
+
+            switch(signal) {
+            case SIGNAL_TONE:
+                v = (int)(16384 * sin(2 * M_PI * (1000 + 500 * ch) * t));
+                break;
+            case SIGNAL_NOISE:
+                v = (int16_t)(bench_rand(&state) >> 16);
+                break;
+            case SIGNAL_TRANSIENT:
+                /* 5 ms noise bursts every 250 ms over a quiet tone */
+                v = (int)(1000 * sin(2 * M_PI * 440 * t));
+                if (i % (sample_rate / 4) < sample_rate / 200)
+                    v = (int16_t)(bench_rand(&state) >> 16);
+                break;
+            case SIGNAL_TREBLE:
+                /* quiet 9 and 11 kHz tones, above the 8 or 12 subbands
+                   of the low bitrate tables */
+                v = (int)(1000 * (sin(2 * M_PI * 9000 * t) + sin(2 * M_PI * 11000 * t)));
+                break;
+            default:
+                v = 0;
+                break;
+            }
+            samples[i * channels + ch] = v;
+        }
+    }
+}
+
+/* the transform part of filter(), on the current subband samples */
+static void bench_idct(MpegAudioContext *s, int ch)
+{
+    int lanes = s->dsp->idct_lanes;
+    int in[32 * 8];
+    int out[32 * 8];
+    int j;
+
+    memcpy(in, s->frame->sb_samples[ch], 32 * lanes * sizeof(*in));
+    for(j=0;j<36;j+=lanes)
+        s->dsp->idct32(out, in, FFMIN(lanes, 36 - j));
+}
+
+static int bench_run(int sample_rate, int channels, int bitrate, int signal,
+                     int psy_model, const int16_t *pcm, int nb_frames)
+{
+    AVCodecContext avctx = { 0 };
+    MpegAudioContext *s;
+    MPAFrame f;
+    MPAInput in;
+    uint8_t encoded[MPA_MAX_CODED_FRAME_SIZE];
+    short smr[MPA_MAX_CHANNELS][SBLIMIT];
+    unsigned char bit_alloc[MPA_MAX_CHANNELS][SBLIMIT];
+    int64_t stage_ns[STAGE_NB] = { 0 };
+    int64_t t0, t1, total = 0;
+    int frame, i, padding;
+
+    s = calloc(1, sizeof(*s));
+    if (!s)
+        return AVERROR(ENOMEM);
+    avctx.priv_data = s;
+    avctx.sample_rate = sample_rate;
+    avctx.channels = channels;
+    avctx.bit_rate = bitrate * 1000;
+    avctx.psy_model = psy_model;
+    if (MPA_encode_init(&avctx) < 0) {
+        free(s);
+        return AVERROR(EINVAL);
+    }
+
+    for(frame=0;frame<nb_frames;frame++) {
+        const void *samples[1] = { pcm + frame * MPA_FRAME_SIZE * channels };
+
+        input_init(s, &in, MPA_SAMPLE_FMT_S16, samples);
+        frame_begin(s, &f);
+        t0 = bench_time();
+        for(i=0;i<channels;i++)
+            s->dsp->filter(s, i, &in);
+        t1 = bench_time();
+        stage_ns[STAGE_FILTER] += t1 - t0;
+
+        t0 = bench_time();
+        if (psy_model == MPA_PSY_MODEL1) {
+            for(i=0;i<channels;i++)
+                psy_analyze(s, i);
+        }
+        t1 = bench_time();
+        stage_ns[STAGE_PSY] += t1 - t0;
+        frame_end(s);
+
+        t0 = bench_time();
+        for(i=0;i<channels;i++)
+            bench_idct(s, i);
+        t1 = bench_time();
+        stage_ns[STAGE_IDCT] += t1 - t0;
+
+        t0 = bench_time();
+        for(i=0;i<channels;i++)
+            compute_scale_factors(s, s->frame->scale_code[i], s->frame->scale_factors[i],
+                                  s->frame->sb_samples[i], s->max_sblimit);
+        for(i=0;i<channels;i++)
+            psycho_acoustic_model(s, i, smr[i]);
+        t1 = bench_time();
+        stage_ns[STAGE_SCALE] += t1 - t0;
+
+        t0 = bench_time();
+        compute_bit_allocation(s, smr, bit_alloc, frame_bit_budget(s), s->sblimit,
+                               INT_MIN, NULL, &padding);
+        t1 = bench_time();
+        stage_ns[STAGE_ALLOC] += t1 - t0;
+
+        t0 = bench_time();
+        init_put_bits(&s->pb, encoded, MPA_MAX_CODED_FRAME_SIZE);
+        encode_frame(s, bit_alloc, padding);
+        t1 = bench_time();
+        stage_ns[STAGE_ENCODE] += t1 - t0;
+    }
+
+    printf("%5d %d %3d %-9s", sample_rate, channels, bitrate, signal_names[signal]);
+    for(i=0;i<STAGE_NB;i++) {
+        printf(" %8.0f", (double)stage_ns[i] / nb_frames);
+        /* the isolated transform is already part of filter() */
+        if (i != STAGE_IDCT)
+            total += stage_ns[i];
+    }
+    printf(" %8.0f %9.0f\n", (double)total / nb_frames,
+           total ? 1e9 * nb_frames / total : 0.0);
+    free(s);
+    return 0;
+}
+
+/* the kernels MPA_encode_init() selects */
+static const char *bench_kernels_name(void)
+{
+    AVCodecContext avctx = { 0 };
+    MpegAudioContext *s = calloc(1, sizeof(*s));
+    int kernels = MPA_KERNELS_AUTO;
+
+    avctx.priv_data = s;
+    avctx.sample_rate = 44100;
+    avctx.channels = 2;
+    if (s && MPA_encode_init(&avctx) >= 0)
+        kernels = avctx.kernels;
+    free(s);
+    return kernels_names[kernels];
+}
+
+/* one configuration per allocation table, see ff_mpa_l2_select_table(),
+   then the variable rate modes, whose frames switch tables */
+static const int quality_configs[][4] = {
+    { 48000, 2, 192, MPA_RC_CBR },
+    { 44100, 2, 128, MPA_RC_CBR },
+    { 44100, 2, 256, MPA_RC_CBR },
+    { 44100, 1,  48, MPA_RC_CBR },
+    { 32000, 1,  48, MPA_RC_CBR },
+    { 24000, 2,  96, MPA_RC_CBR },
+    { 44100, 2, 128, MPA_RC_VBR },
+    { 44100, 2,  96, MPA_RC_ABR },
+};
+
+/* signal and coding noise of the frames, by channel and subband */
+typedef struct QualityStats {
+    double signal[MPA_MAX_CHANNELS][SBLIMIT];
+    double noise[MPA_MAX_CHANNELS][SBLIMIT];
+    double nmr_sum[SBLIMIT];
+    int nb[SBLIMIT];
+} QualityStats;
+
+/* subbands of a frame below this energy, about -100 dB, are left out */
+#define QUALITY_MIN_ENERGY (36 * 1e-10)
+
+/* reference analysis filter bank of the standard, in double precision */
+typedef struct RefAnalysis {
+    double window[512];         /* C[i] */
+    double matrix[SBLIMIT][64]; /* M[k][i] */
+    double x[MPA_MAX_CHANNELS][512];
+} RefAnalysis;
+
+static void ref_analysis_init(RefAnalysis *a)
+{
+    int i, k, v;
+
+    memset(a, 0, sizeof(*a));
+    for(i=0;i<257;i++) {
+        v = ff_mpa_enwindow[i];
+        a->window[i] = v / (65536.0 * 32);
+        if ((i & 63) != 0)
+            v = -v;
+        if (i != 0)
+            a->window[512 - i] = v / (65536.0 * 32);
+    }
+    for(k=0;k<SBLIMIT;k++)
+        for(i=0;i<64;i++)
+            a->matrix[k][i] = cos((2 * k + 1) * (i - 16) * M_PI / 64);
+}
+
+/* the 32 subband samples of the next 32 samples of channel ch, taken
+   every stride samples */
+static void ref_analysis_slot(RefAnalysis *a, int ch, const double *in, int stride,
+                              double sb[SBLIMIT])
+{
+    double *x = a->x[ch];
+    double y[64];
+    int i, j, k;
+
+    memmove(x + 32, x, (512 - 32) * sizeof(*x));
+    for(i=0;i<32;i++)
+        x[31 - i] = in[i * stride];
+    for(i=0;i<64;i++) {
+        y[i] = 0;
+        for(j=0;j<8;j++)
+            y[i] += a->window[i + 64 * j] * x[i + 64 * j];
+    }
+    for(k=0;k<SBLIMIT;k++) {
+        sb[k] = 0;
+        for(i=0;i<64;i++)
+            sb[k] += a->matrix[k][i] * y[i];
+    }
+}
+
+static int quality_run(int sample_rate, int channels, int bitrate, int rc_mode, int signal,
+                       int psy_model, const int16_t *pcm, int nb_frames)
+{
+    AVCodecContext avctx = { 0 }, psy_avctx = { 0 };
+    MpegAudioContext *s, *psy;
+    MPADecoder *dec;
+    RefAnalysis *ref = NULL, *ref_err = NULL;
+    QualityStats *st = NULL;
+    uint8_t *encoded = NULL;
+    int *frame_sizes = NULL, *frame_offsets = NULL;
+    float *decoded = NULL;
+    double *x = NULL, *e = NULL;
+    double total_signal = 0, total_noise = 0, nmr_mean = 0, nmr_max = -1e9, total_bytes = 0;
+    int64_t t0, t1;
+    int frame, n, i, j, ch, pos, delay, sblimit, nb = 0, ret = AVERROR(ENOMEM);
+
+    s = calloc(1, sizeof(*s));
+    psy = calloc(1, sizeof(*psy));
+    dec = MPA_decode_create();
+    encoded = malloc((size_t)nb_frames * MPA_MAX_CODED_FRAME_SIZE);
+    frame_sizes = malloc(nb_frames * sizeof(*frame_sizes));
+    frame_offsets = malloc(nb_frames * sizeof(*frame_offsets));
+    decoded = malloc((size_t)nb_frames * MPA_FRAME_SIZE * channels * sizeof(*decoded));
+    x = malloc((size_t)nb_frames * MPA_FRAME_SIZE * channels * sizeof(*x));
+    e = calloc((size_t)nb_frames * MPA_FRAME_SIZE * channels, sizeof(*e));
+    ref = malloc(sizeof(*ref));
+    ref_err = malloc(sizeof(*ref_err));
+    st = calloc(1, sizeof(*st));
+    if (!s || !psy || !dec || !encoded || !frame_sizes || !frame_offsets || !decoded ||
+        !x || !e || !ref || !ref_err || !st)
+        goto end;
+
+    avctx.priv_data = s;
+    avctx.sample_rate = sample_rate;
+    avctx.channels = channels;
+    avctx.bit_rate = bitrate * 1000;
+    avctx.psy_model = psy_model;
+    avctx.rc_mode = rc_mode;
+    /* the same subbands are analysed for the mask */
+    psy_avctx = avctx;
+    psy_avctx.priv_data = psy;
+    psy_avctx.psy_model = MPA_PSY_MODEL1;
+    ret = AVERROR(EINVAL);
+    if (MPA_encode_init(&avctx) < 0 || MPA_encode_init(&psy_avctx) < 0)
+        goto end;
+    /* the variable modes switch tables, the subbands over the sblimit of a
+       frame are not coded at all */
+    sblimit = rc_mode == MPA_RC_CBR ? s->sblimit : s->max_sblimit;
+
+    t0 = bench_time();
+    n = MPA_encode_frames(&avctx, pcm, nb_frames, encoded, nb_frames * MPA_MAX_CODED_FRAME_SIZE,
+                          frame_sizes, frame_offsets);
+    t1 = bench_time();
+    if (n != nb_frames)
+        goto end;
+    for(frame=0;frame<nb_frames;frame++) {
+        total_bytes += frame_sizes[frame];
+        if (MPA_decode_frame(dec, encoded + frame_offsets[frame], frame_sizes[frame],
+                             decoded + frame * MPA_FRAME_SIZE * channels, NULL) < 0)
+            goto end;
+    }
+
+    /* the coding noise, with the decoded samples delayed by the filter banks */
+    delay = avctx.initial_padding;
+    for(i=0;i<nb_frames * MPA_FRAME_SIZE * channels;i++)
+        x[i] = pcm[i] / 32768.0;
+    for(i=0;i<(nb_frames * MPA_FRAME_SIZE - delay) * channels;i++) {
+        e[i] = decoded[i + delay * channels] - x[i];
+        total_signal += x[i] * x[i];
+        total_noise += e[i] * e[i];
+    }
+
+    ref_analysis_init(ref);
+    ref_analysis_init(ref_err);
+    /* the last frame is only partly decoded */
+    for(frame=0;frame<nb_frames-1;frame++) {
+        const void *samples[1] = { pcm + frame * MPA_FRAME_SIZE * channels };
+        MPAInput in;
+        MPAFrame f;
+
+        /* the masking of the frame */
+        input_init(psy, &in, MPA_SAMPLE_FMT_S16, samples);
+        frame_begin(psy, &f);
+        for(ch=0;ch<channels;ch++) {
+            psy->dsp->filter(psy, ch, &in);
+            psy_analyze(psy, ch);
+        }
+        frame_end(psy);
+        psy->frame = NULL;
+
+        for(ch=0;ch<channels;ch++) {
+            double sig[SBLIMIT] = { 0 }, noise[SBLIMIT] = { 0 };
+            for(j=0;j<36;j++) {
+                double sbx[SBLIMIT], sbe[SBLIMIT];
+                pos = ((frame * 36 + j) * 32) * channels + ch;
+                ref_analysis_slot(ref, ch, x + pos, channels, sbx);
+                ref_analysis_slot(ref_err, ch, e + pos, channels, sbe);
+                for(i=0;i<SBLIMIT;i++) {
+                    sig[i] += sbx[i] * sbx[i];
+                    noise[i] += sbe[i] * sbe[i];
+                }
+            }
+            /* the first frame fills the filter banks */
+            if (!frame)
+                continue;
+            for(i=0;i<sblimit;i++) {
+                double snr;
+                if (sig[i] < QUALITY_MIN_ENERGY)
+                    continue;
+                snr = 10 * log10(sig[i] / FFMAX(noise[i], sig[i] * 1e-12));
+                st->signal[ch][i] += sig[i];
+                st->noise[ch][i] += noise[i];
+                st->nmr_sum[i] += 10 * log10(f.psy_level[ch][i] / f.psy_mask[ch][i]) - snr;
+                st->nb[i]++;
+            }
+        }
+    }
+
+    /* the mean bitrate of the variable modes, their tables vary */
+    if (rc_mode == MPA_RC_CBR)
+        printf("%5d %d %3d %2d", sample_rate, channels, bitrate, s->table);
+    else
+        printf("%5d %d %3.0f %2s", sample_rate, channels,
+               total_bytes * 8 * sample_rate / ((double)nb_frames * MPA_FRAME_SIZE * 1000),
+               rc_mode == MPA_RC_VBR ? "v" : "a");
+    printf(" %-9s %9.0f %6.1f", signal_names[signal], t1 > t0 ? 1e9 * nb_frames / (t1 - t0) : 0.0,
+           10 * log10(total_signal / FFMAX(total_noise, 1e-30)));
+    for(i=0;i<sblimit;i++) {
+        if (st->nb[i]) {
+            nmr_mean += st->nmr_sum[i];
+            nb += st->nb[i];
+            nmr_max = FFMAX(nmr_max, st->nmr_sum[i] / st->nb[i]);
+        }
+    }
+    if (nb)
+        printf(" %8.1f %8.1f\n", nmr_mean / nb, nmr_max);
+    else
+        printf(" %8s %8s\n", "-", "-");
+
+    printf("  SNR");
+    for(i=0;i<sblimit;i++) {
+        double sig = 0, noise = 0;
+        for(ch=0;ch<channels;ch++) {
+            sig += st->signal[ch][i];
+            noise += st->noise[ch][i];
+        }
+        if (st->nb[i])
+            printf(" %5.1f", 10 * log10(sig / FFMAX(noise, sig * 1e-12)));
+        else
+            printf(" %5s", "-");
+    }
+    printf("\n  NMR");
+    for(i=0;i<sblimit;i++) {
+        if (st->nb[i])
+            printf(" %5.1f", st->nmr_sum[i] / st->nb[i]);
+        else
+            printf(" %5s", "-");
+    }
+    printf("\n");
+    ret = 0;
+
+end:
+    free(s);
+    free(psy);
+    MPA_decode_destroy(dec);
+    free(encoded);
+    free(frame_sizes);
+    free(frame_offsets);
+    free(decoded);
+    free(x);
+    free(e);
+    free(ref);
+    free(ref_err);
+    free(st);
+    return ret;
+}
+
+static int quality_main(int nb_frames, int psy_model)
+{
+    int16_t *pcm;
+    int c, sig;
+
+    pcm = malloc((size_t)nb_frames * MPA_FRAME_SIZE * MPA_MAX_CHANNELS * sizeof(*pcm));
+    if (!pcm)
+        return 1;
+
+    printf("%d frames per run, psycho acoustic model %d, %s kernels, SNR and NMR in dB for each subband\n",
+           nb_frames, psy_model, bench_kernels_name());
+    printf(" rate c kbs tb signal     frames/s    SNR NMR mean  NMR max\n");
+    for(c=0;c<(int)(sizeof(quality_configs) / sizeof(*quality_configs));c++) {
+        const int *cfg = quality_configs[c];
+        for(sig=SIGNAL_TONE;sig<SIGNAL_NB;sig++) {
+            make_signal(pcm, nb_frames * MPA_FRAME_SIZE, cfg[1], cfg[0], sig);
+            if (quality_run(cfg[0], cfg[1], cfg[2], cfg[3], sig, psy_model, pcm, nb_frames) < 0)
+                printf("%5d %d %3d    %-9s failed\n", cfg[0], cfg[1], cfg[2], signal_names[sig]);
+        }
+    }
+    free(pcm);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int quality = argc > 1 && !strcmp(argv[1], "-q");
+    int nb_frames, psy_model;
+    int16_t *pcm;
+    int r, ch, b, sig, i;
+
+    if (quality) {
+        argc--;
+        argv++;
+    }
+    nb_frames = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_FRAMES;
+    psy_model = argc > 2 ? atoi(argv[2]) : MPA_PSY_MODEL1;
+
+    if (nb_frames <= 0)
+        nb_frames = BENCH_DEFAULT_FRAMES;
+    if (psy_model < 0 || psy_model >= MPA_PSY_NB)
+        psy_model = MPA_PSY_MODEL1;
+    if (quality)
+        return quality_main(FFMAX(nb_frames, 3), psy_model);
+    pcm = malloc((size_t)nb_frames * MPA_FRAME_SIZE * MPA_MAX_CHANNELS * sizeof(*pcm));
+    if (!pcm)
+        return 1;
+
+    printf("%d frames per run, psycho acoustic model %d, %s kernels, ns per frame for each stage\n",
+           nb_frames, psy_model, bench_kernels_name());
+    printf(" rate c kbs signal   ");
+    for(i=0;i<STAGE_NB;i++)
+        printf(" %8s", stage_names[i]);
+    printf(" %8s %9s\n", "total", "frames/s");
+
+    for(r=0;r<6;r++) {
+        int lsf = r >= 3;
+        for(ch=1;ch<=MPA_MAX_CHANNELS;ch++) {
+            for(sig=0;sig<SIGNAL_TREBLE;sig++) {
+                make_signal(pcm, nb_frames * MPA_FRAME_SIZE, ch, bench_rates[r], sig);
+                for(b=0;b<3;b++)
+                    bench_run(bench_rates[r], ch, bench_bitrates[lsf][ch - 1][b], sig,
+                              psy_model, pcm, nb_frames);
+            }
+        }
+    }
+    free(pcm);
+    return 0;
+}
@@ -0,0 +1,262 @@
+/*
+ * Reference mpeg audio layer 2 decoder
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Minimal Layer II decoder, to measure the quality of the encoder.
+ *
+ * It follows the reference decoding process of ISO/IEC 11172-3 in double
+ * precision, with the matrixing and the synthesis window computed
+ * directly rather than with a fast transform: it is meant to be obviously
+ * right, not fast. It shares the Layer II tables of the encoder.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mp2dec.h"
+
+struct MPADecoder {
+    double synth_window[512];           /* D[i] of the standard */
+    double matrix[64][32];              /* N[i][k] of the standard */
+    double v[MPA_MAX_CHANNELS][1024];   /* synthesis history */
+};
+
+typedef struct BitReader {
+    const uint8_t *buf;
+    int index, size_in_bits;
+} BitReader;
+
+/* reads past the end return zeros */
+static unsigned get_bits(BitReader *br, int n)
+{
+    unsigned v = 0;
+
+    while (n--) {
+        int bit = 0;
+        if (br->index < br->size_in_bits)
+            bit = (br->buf[br->index >> 3] >> (7 - (br->index & 7))) & 1;
+        br->index++;
+        v = (v << 1) | bit;
+    }
+    return v;
+}
+
+int MPA_decode_header(const uint8_t *buf, int size, MPAFrameInfo *info)
+{
+    int lsf, bitrate_index, freq_index, padding;
+
+    if (size < 4 || buf[0] != 0xff || (buf[1] & 0xe0) != 0xe0)
+        return AVERROR(EINVAL);
+    /* MPEG-1 or MPEG-2 Layer II, no MPEG-2.5 */
+    if (!(buf[1] & 0x10) || ((buf[1] >> 1) & 3) != 2)
+        return AVERROR(EINVAL);
+    lsf = !(buf[1] & 0x08);
+    bitrate_index = buf[2] >> 4;
+    freq_index = (buf[2] >> 2) & 3;
+    padding = (buf[2] >> 1) & 1;
+    if (bitrate_index == 0 || bitrate_index == 15 || freq_index == 3)
+        return AVERROR(EINVAL);
+
+    info->sample_rate = avpriv_mpa_freq_tab[freq_index] >> lsf;
+    info->bit_rate = avpriv_mpa_bitrate_tab[lsf][1][bitrate_index] * 1000;
+    info->mode = buf[3] >> 6;
+    info->channels = info->mode == MPA_MONO ? 1 : 2;
+    info->frame_size = 144 * info->bit_rate / info->sample_rate + padding;
+    info->table = ff_mpa_l2_select_table(info->bit_rate / 1000, info->channels,
+                                         info->sample_rate, lsf);
+    return 0;
+}
+
+MPADecoder *MPA_decode_create(void)
+{
+    MPADecoder *dec = calloc(1, sizeof(*dec));
+    int i, k, v;
+
+    if (!dec)
+        return NULL;
+    /* the full window from its first half, as for the encoder */
+    for(i=0;i<257;i++) {
+        v = ff_mpa_enwindow[i];
+        dec->synth_window[i] = v / 65536.0;
+        if ((i & 63) != 0)
+            v = -v;
+        if (i != 0)
+            dec->synth_window[512 - i] = v / 65536.0;
+    }
+    for(i=0;i<64;i++)
+        for(k=0;k<32;k++)
+            dec->matrix[i][k] = cos((16 + i) * (2 * k + 1) * M_PI / 64);
+    return dec;
+}
+
+/* 32 output samples, every channels samples in out, from the 32 subband
+   samples of a time slot */
+static void synth_slot(MPADecoder *dec, int ch, const double sb[SBLIMIT],
+                       float *out, int channels)
+{
+    double *v = dec->v[ch];
+    double sum;
+    int i, j, k;
+
+    memmove(v + 64, v, (1024 - 64) * sizeof(*v));
+    for(i=0;i<64;i++) {
+        sum = 0;
+        for(k=0;k<32;k++)
+            sum += dec->matrix[i][k] * sb[k];
+        v[i] = sum;
+    }
+    /* windowing of the vector U built from V */
+    for(j=0;j<32;j++) {
+        sum = 0;
+        for(i=0;i<8;i++) {
+            sum += v[128 * i + j]      * dec->synth_window[64 * i + j];
+            sum += v[128 * i + 96 + j] * dec->synth_window[64 * i + 32 + j];
+        }
+        out[j * channels] = (float)sum;
+    }
+}
+
+int MPA_decode_frame(MPADecoder *dec, const uint8_t *buf, int size, float *samples,
+                     MPAFrameInfo *info)
+{
+    MPAFrameInfo hdr;
+    BitReader br;
+    const unsigned char *alloc_table;
+    unsigned char bit_alloc[MPA_MAX_CHANNELS][SBLIMIT] = { { 0 } };
+    unsigned char scfsi[MPA_MAX_CHANNELS][SBLIMIT];
+    unsigned char scale_factors[MPA_MAX_CHANNELS][SBLIMIT][3];
+    double sb[MPA_MAX_CHANNELS][3][12][SBLIMIT];
+    int offsets[SBLIMIT];
+    int nb_channels, sblimit, bound, i, j, k, l, m, ch, ret;
+
+    if ((ret = MPA_decode_header(buf, size, &hdr)) < 0)
+        return ret;
+    if (hdr.frame_size > size)
+        return AVERROR(EINVAL);
+    if (info)
+        *info = hdr;
+
+    br.buf = buf;
+    br.index = 32;
+    br.size_in_bits = hdr.frame_size * 8;
+    if (!(buf[1] & 1))
+        get_bits(&br, 16);  /* CRC, not checked */
+
+    nb_channels = hdr.channels;
+    sblimit = ff_mpa_sblimit_table[hdr.table];
+    alloc_table = ff_mpa_alloc_tables[hdr.table];
+    bound = sblimit;
+    if (hdr.mode == MPA_JSTEREO)
+        bound = FFMIN(((buf[3] >> 4) & 3) * 4 + 4, sblimit);
+    for(i=0,j=0;i<sblimit;i++) {
+        offsets[i] = j;
+        j += 1 << alloc_table[j];
+    }
+
+    /* bit allocation, shared by the channels above the bound */
+    for(i=0;i<sblimit;i++) {
+        int bits = alloc_table[offsets[i]];
+        if (i < bound) {
+            for(ch=0;ch<nb_channels;ch++)
+                bit_alloc[ch][i] = get_bits(&br, bits);
+        } else {
+            bit_alloc[0][i] = get_bits(&br, bits);
+            bit_alloc[1][i] = bit_alloc[0][i];
+        }
+    }
+    for(i=0;i<sblimit;i++)
+        for(ch=0;ch<nb_channels;ch++)
+            if (bit_alloc[ch][i])
+                scfsi[ch][i] = get_bits(&br, 2);
+    for(i=0;i<sblimit;i++) {
+        for(ch=0;ch<nb_channels;ch++) {
+            unsigned char *sf = scale_factors[ch][i];
+            if (!bit_alloc[ch][i])
+                continue;
+            switch(scfsi[ch][i]) {
+            case 0:
+                sf[0] = get_bits(&br, 6);
+                sf[1] = get_bits(&br, 6);
+                sf[2] = get_bits(&br, 6);
+                break;
+            case 1:
+                sf[0] = sf[1] = get_bits(&br, 6);
+                sf[2] = get_bits(&br, 6);
+                break;
+            case 2:
+                sf[0] = sf[1] = sf[2] = get_bits(&br, 6);
+                break;
+            default:
+                sf[0] = get_bits(&br, 6);
+                sf[1] = sf[2] = get_bits(&br, 6);
+                break;
+            }
+        }
+    }
+
+    /* samples, by granules of 3 for each subband */
+    memset(sb, 0, sizeof(sb));
+    for(k=0;k<3;k++) {
+        for(l=0;l<12;l+=3) {
+            for(i=0;i<sblimit;i++) {
+                for(ch=0;ch<(i < bound ? nb_channels : 1);ch++) {
+                    int b = bit_alloc[ch][i], q, steps, bits, v[3];
+                    if (!b)
+                        continue;
+                    q = alloc_table[offsets[i] + b];
+                    steps = ff_mpa_quant_steps[q];
+                    bits = ff_mpa_quant_bits[q];
+                    if (bits < 0) {
+                        /* 3 samples grouped in one code */
+                        unsigned code = get_bits(&br, -bits);
+                        v[0] = code % steps;
+                        code /= steps;
+                        v[1] = code % steps;
+                        v[2] = code / steps;
+                    } else {
+                        v[0] = get_bits(&br, bits);
+                        v[1] = get_bits(&br, bits);
+                        v[2] = get_bits(&br, bits);
+                    }
+                    for(m=0;m<3;m++) {
+                        double x = (2.0 * v[m] + 1) / steps - 1;
+                        int c;
+                        for(c=ch;c<(i < bound ? ch + 1 : nb_channels);c++)
+                            sb[c][k][l + m][i] = x * pow(2, (3 - scale_factors[c][i][k]) / 3.0);
+                    }
+                }
+            }
+        }
+    }
+
+    for(k=0;k<3;k++)
+        for(l=0;l<12;l++)
+            for(ch=0;ch<nb_channels;ch++)
+                synth_slot(dec, ch, sb[ch][k][l], samples + (k * 12 + l) * 32 * nb_channels + ch,
+                           nb_channels);
+    return hdr.frame_size;
+}
+
+void MPA_decode_destroy(MPADecoder *dec)
+{
+    free(dec);
+}
@@ -0,0 +1,65 @@
+/*
+ * Reference mpeg audio layer 2 decoder
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MP2DEC_H
+#define MP2DEC_H
+
+#include "mp2en.h"
+
+typedef struct MPADecoder MPADecoder;
+
+/**
+ * Header fields of a frame.
+ */
+typedef struct MPAFrameInfo {
+    int frame_size;     ///< in bytes, with the padding slot
+    int sample_rate;
+    int channels;
+    int bit_rate;
+    int mode;           ///< MPA_STEREO, MPA_JSTEREO, MPA_DUAL or MPA_MONO
+    int table;          ///< allocation table, index in ff_mpa_alloc_tables
+} MPAFrameInfo;
+
+/**
+ * Parse the header of the Layer II frame at buf.
+ *
+ * @return 0 on success, AVERROR(EINVAL) if buf does not start with a
+ *         Layer II header this decoder handles (free format is not)
+ */
+int MPA_decode_header(const uint8_t *buf, int size, MPAFrameInfo *info);
+
+/**
+ * @return a decoder, or NULL on failure
+ */
+MPADecoder *MPA_decode_create(void);
+
+/**
+ * Decode the frame at buf into MPA_FRAME_SIZE interleaved samples per
+ * channel, full scale being 1.0. The samples are not clipped.
+ *
+ * @param info if not NULL, receives the header of the frame
+ * @return the size in bytes of the frame, or a negative error code
+ */
+int MPA_decode_frame(MPADecoder *dec, const uint8_t *buf, int size, float *samples,
+                     MPAFrameInfo *info);
+
+void MPA_decode_destroy(MPADecoder *dec);
+
+#endif
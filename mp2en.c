@@ -24,9 +24,12 @@
  * The simplest mpeg audio layer 2 encoder.
  */
 
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <math.h>
 
 #define FRAC_PADDING    0
 
@@ -39,11 +42,42 @@
 //#include "mpegaudiotab.h"
 #include "mp2en.h"
 
+#if HAVE_AVX2
+#include <immintrin.h>
+#elif HAVE_SSE2
+#include <emmintrin.h>
+#elif HAVE_NEON
+#include <arm_neon.h>
+#endif
+/* the AVX2 kernels are selected at run time, so they are built for AVX2
+   whatever the target of the rest of the code */
+#if HAVE_AVX2 && !defined(__AVX2__) && (defined(__GNUC__) || defined(__clang__))
+#    define av_target_avx2 __attribute__((target("avx2")))
+#else
+#    define av_target_avx2
+#endif
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+#if ENCODE_STATS
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+#endif
+
 #define TABLE_GENERATE      0
 
 //-----------------
+/* big endian bit writer with a 64 bit accumulator */
+typedef uint64_t BitBuf;
+#define BUF_BITS 64
+
 typedef struct PutBitContext {
-    uint32_t bit_buf;
+    BitBuf bit_buf;
     int bit_left;
     uint8_t* buf, * buf_ptr, * buf_end;
     int size_in_bits;
@@ -66,7 +100,7 @@ static inline void init_put_bits(PutBitContext* s, uint8_t* buffer, int buffer_s
     s->buf = buffer;
     s->buf_end = s->buf + buffer_size;
     s->buf_ptr = s->buf;
-    s->bit_left = 32;
+    s->bit_left = BUF_BITS;
     s->bit_buf = 0;
 }
 
@@ -75,7 +109,7 @@ static inline void init_put_bits(PutBitContext* s, uint8_t* buffer, int buffer_s
  */
 static inline int put_bits_count(PutBitContext* s)
 {
-    return (s->buf_ptr - s->buf) * 8 + 32 - s->bit_left;
+    return (s->buf_ptr - s->buf) * 8 + BUF_BITS - s->bit_left;
 }
 
 /**
@@ -83,56 +117,43 @@ static inline int put_bits_count(PutBitContext* s)
  */
 static inline void flush_put_bits(PutBitContext* s)
 {
-#ifndef BITSTREAM_WRITER_LE
-    if (s->bit_left < 32)
+    if (s->bit_left < BUF_BITS)
         s->bit_buf <<= s->bit_left;
-#endif
-    while (s->bit_left < 32) {
+    while (s->bit_left < BUF_BITS) {
         av_assert0(s->buf_ptr < s->buf_end);
-#ifdef BITSTREAM_WRITER_LE
-        * s->buf_ptr++ = s->bit_buf;
-        s->bit_buf >>= 8;
-#else
-        * s->buf_ptr++ = s->bit_buf >> 24;
+        * s->buf_ptr++ = s->bit_buf >> (BUF_BITS - 8);
         s->bit_buf <<= 8;
-#endif
         s->bit_left += 8;
     }
-    s->bit_left = 32;
+    s->bit_left = BUF_BITS;
     s->bit_buf = 0;
 }
 
+static inline void put_bits_flush_word(PutBitContext* s, BitBuf bit_buf)
+{
+    if (7 < s->buf_end - s->buf_ptr) {
+        AV_WB64(s->buf_ptr, bit_buf);
+        s->buf_ptr += 8;
+    }
+    else {
+        av_log(NULL, AV_LOG_ERROR, "Internal error, put_bits buffer too small\n");
+        av_assert2(0);
+    }
+}
+
 /**
- * Write up to 31 bits into a bitstream.
- * Use put_bits32 to write 32 bits.
+ * Write up to 63 bits into a bitstream.
  */
-static inline void put_bits(PutBitContext* s, int n, unsigned int value)
+static inline void put_bits64(PutBitContext* s, int n, BitBuf value)
 {
-    unsigned int bit_buf;
+    BitBuf bit_buf;
     int bit_left;
 
-    av_assert2(n <= 31 && value < (1U << n));
+    av_assert2(n < BUF_BITS && value < ((BitBuf)1 << n));
 
     bit_buf = s->bit_buf;
     bit_left = s->bit_left;
 
-    /* XXX: optimize */
-#ifdef BITSTREAM_WRITER_LE
-    bit_buf |= value << (32 - bit_left);
-    if (n >= bit_left) {
-        if (3 < s->buf_end - s->buf_ptr) {
-            AV_WL32(s->buf_ptr, bit_buf);
-            s->buf_ptr += 4;
-        }
-        else {
-            av_log(NULL, AV_LOG_ERROR, "Internal error, put_bits buffer too small\n");
-            av_assert2(0);
-        }
-        bit_buf = value >> bit_left;
-        bit_left += 32;
-    }
-    bit_left -= n;
-#else
     if (n < bit_left) {
         bit_buf = (bit_buf << n) | value;
         bit_left -= n;
@@ -140,22 +161,50 @@ static inline void put_bits(PutBitContext* s, int n, unsigned int value)
     else {
         bit_buf <<= bit_left;
         bit_buf |= value >> (n - bit_left);
-        if (3 < s->buf_end - s->buf_ptr) {
-            AV_WB32(s->buf_ptr, bit_buf);
-            s->buf_ptr += 4;
-        }
-        else {
-            av_log(NULL, AV_LOG_ERROR, "Internal error, put_bits buffer too small\n");
-            av_assert2(0);
-        }
-        bit_left += 32 - n;
+        put_bits_flush_word(s, bit_buf);
+        bit_left += BUF_BITS - n;
         bit_buf = value;
     }
-#endif
 
     s->bit_buf = bit_buf;
     s->bit_left = bit_left;
 }
+
+/**
+ * Write up to 32 bits into a bitstream.
+ */
+static inline void put_bits(PutBitContext* s, int n, unsigned int value)
+{
+    put_bits64(s, n, value);
+}
+
+/**
+ * Write n zero bits, whole bytes are filled with memset().
+ */
+static inline void put_bits_zero(PutBitContext* s, int n)
+{
+    int bytes;
+
+    if (n < s->bit_left) {
+        s->bit_buf <<= n;
+        s->bit_left -= n;
+        return;
+    }
+    /* complete the current word */
+    if (s->bit_left < BUF_BITS) {
+        n -= s->bit_left;
+        put_bits_flush_word(s, s->bit_buf << s->bit_left);
+    }
+    bytes = n >> 3;
+    if (bytes > s->buf_end - s->buf_ptr) {
+        av_log(NULL, AV_LOG_ERROR, "Internal error, put_bits buffer too small\n");
+        bytes = s->buf_end - s->buf_ptr;
+    }
+    memset(s->buf_ptr, 0, bytes);
+    s->buf_ptr += bytes;
+    s->bit_buf = 0;
+    s->bit_left = BUF_BITS - (n & 7);
+}
 //------------------------------------------------
 
 static const int costab32[30] = {
@@ -344,8 +393,8 @@ const unsigned char* const ff_mpa_alloc_tables[5] =
 { alloc_table_1, alloc_table_1, alloc_table_3, alloc_table_3, alloc_table_4, };
 
 //---------------------------------------------
-/* half mpeg encoding window (full precision) */
-#if TABLE_GENERATE
+/* half mpeg encoding window (full precision), also the synthesis window
+   of mp2dec.c */
 const int32_t ff_mpa_enwindow[257] = {
      0,    -1,    -1,    -1,    -1,    -1,    -1,    -2,
     -2,    -2,    -2,    -3,    -3,    -4,    -4,    -5,
@@ -381,16 +430,92 @@ const int32_t ff_mpa_enwindow[257] = {
 -72169,-72835,-73415,-73908,-74313,-74630,-74856,-74992,
  75038,
 };
-#endif
 
 /* currently, cannot change these constants (need to modify
    quantization stage) */
 #define MUL(a,b) (((int64_t)(a) * (int64_t)(b)) >> FRAC_BITS)
 
-#define SAMPLES_BUF_SIZE 4096
+/* the filter history is a ring of SAMPLES_RING_SIZE samples; its first
+   512 - 32 entries are mirrored after the end so that the 512 sample
+   window can always be read contiguously without moving data. The ring
+   goes round once per frame, from the SAMPLES_HIST_SIZE samples kept in
+   the context. */
+#define SAMPLES_RING_SIZE MPA_FRAME_SIZE
+#define SAMPLES_HIST_SIZE (512 - 32)
+#define SAMPLES_BUF_SIZE  (SAMPLES_RING_SIZE + SAMPLES_HIST_SIZE)
+
+/* Resampling from AVCodecContext.input_rate: a polyphase FIR filter of
+   RS_ZERO_CROSSINGS zero crossings on each side at the lower of the two
+   rates, so its taps grow with the decimation ratio, which is limited
+   to RS_MAX_RATIO. The coefficients of each pair of rates are built
+   once, for up to RS_MAX_TABLES pairs. */
+#define RS_ZERO_CROSSINGS 24
+#define RS_MAX_RATIO      4
+#define RS_MAX_TAPS       (2 * RS_ZERO_CROSSINGS * RS_MAX_RATIO)
+#define RS_MAX_PHASES     1024
+#define RS_MAX_TABLES     16
+#define RS_CUTOFF         0.92 /* of the lower Nyquist frequency */
+#define RS_KAISER_BETA    8.0
+
+/* the masking threshold is computed on a grid of PSY_GRID_STEPS points
+   per Bark, up to the 25 Bark of 24 kHz */
+#define PSY_FFT_SIZE    1024
+#define PSY_GRID_STEPS  4
+#define PSY_GRID_SIZE   104
+
+/* Rate control: the bits a frame needs to bring its subbands down to a
+   noise to mask ratio are sampled from RC_NMR_MAX down in steps of
+   RC_NMR_STEP (0.1 dB). MPA_RC_ABR looks RC_LOOKAHEAD frames ahead
+   (MPA_MAX_FLUSH_FRAMES allows for them), spends the saved bits over
+   RC_SPREAD_FRAMES frames and saves no more than RC_RESERVOIR_FRAMES
+   frames worth of bits. */
+#define RC_NMR_MAX          300
+#define RC_NMR_STEP         10
+#define RC_CURVE_SIZE       61
+#define RC_CURVE_NMR(c)     (RC_NMR_MAX - (c) * RC_NMR_STEP)
+#define RC_LOOKAHEAD        8
+#define RC_SPREAD_FRAMES    16
+#define RC_RESERVOIR_FRAMES 38
+
+/* The data of one frame, from the analysis to the packing. None of it
+   is carried over to the next frame, so it is not part of the context
+   but on the stack of the encoding calls, see frame_begin(). */
+typedef struct MPAFrame {
+    short samples_buf[MPA_MAX_CHANNELS][SAMPLES_BUF_SIZE]; /* buffer for filter */
+    int samples_offset[MPA_MAX_CHANNELS];       /* offset in samples_buf */
+    int sb_samples[MPA_MAX_CHANNELS][3][12][SBLIMIT];
+    unsigned char scale_factors[MPA_MAX_CHANNELS][SBLIMIT][3]; /* scale factors */
+    /* code to group 3 scale factors */
+    unsigned char scale_code[MPA_MAX_CHANNELS][SBLIMIT];
+    /* intensity stereo: the shared samples */
+    int sb_joint[3][12][SBLIMIT];
+    unsigned char joint_scale_factors[SBLIMIT][3];
+    unsigned char joint_scale_code[SBLIMIT];
+    float psy_level[MPA_MAX_CHANNELS][SBLIMIT];    /* signal power in each subband */
+    float psy_mask[MPA_MAX_CHANNELS][SBLIMIT];     /* lowest masking threshold in each subband */
+    int rc_curve[RC_CURVE_SIZE]; /* MPA_RC_ABR: bits needed per RC_CURVE_NMR() */
+} MPAFrame;
+
+/* a channel mixed down from the input: the sum of its nb input channels
+   in[] with the Q14 gains coefs[] */
+typedef struct MPADownmix {
+    int nb;
+    unsigned char in[MPA_MAX_INPUT_CHANNELS];
+    short coefs[MPA_MAX_INPUT_CHANNELS];
+} MPADownmix;
+
+/* what each channel carries over from frame to frame */
+typedef struct MPAChannelState {
+    /* the 512 - 32 last input samples, most recent first, for the filter bank */
+    short samples_hist[SAMPLES_HIST_SIZE];
+    /* with a resampler, its last input samples, oldest first */
+    short rs_hist[RS_MAX_TAPS];
+} MPAChannelState;
 
 typedef struct MpegAudioContext {
     PutBitContext pb;
+    const struct MPADSPContext *dsp;
+    const struct MPAFrameFuncs *funcs; /* bit allocation and packing of the table */
     int nb_channels;
     int lsf;           /* 1 if mpeg2 low bitrate selected */
     int bitrate_index; /* bit rate */
@@ -401,23 +526,118 @@ typedef struct MpegAudioContext {
     int frame_frac, frame_frac_incr;
 #endif
     int do_padding;
-    short samples_buf[MPA_MAX_CHANNELS][SAMPLES_BUF_SIZE]; /* buffer for filter */
-    int samples_offset[MPA_MAX_CHANNELS];       /* offset in samples_buf */
-    int sb_samples[MPA_MAX_CHANNELS][3][12][SBLIMIT];
-    unsigned char scale_factors[MPA_MAX_CHANNELS][SBLIMIT][3]; /* scale factors */
-    /* code to group 3 scale factors */
-    unsigned char scale_code[MPA_MAX_CHANNELS][SBLIMIT];
+    uint32_t header; /* frame header, without the bitrate and padding bit */
+    /* bitrate indexes usable by the stream, increasing; only one in CBR */
+    int nb_bitrates;
+    unsigned char bitrates[15];
+    int rc_mode;
+    int rc_target;          /* MPA_RC_VBR: noise to mask ratio, 0.1 dB */
+    int rc_frame_bits;      /* MPA_RC_ABR: mean frame size */
+    int rc_reservoir;       /* MPA_RC_ABR: bits saved against the mean */
+    /* intensity stereo: from the subband jsbound the channels share the
+       samples of MPAFrame.sb_joint, with their own scale factors */
+    int joint_stereo;
+    int jsbound;
     int sblimit; /* number of used subbands */
-    const unsigned char *alloc_table;
+    int max_sblimit; /* subbands analysed, the most of any bitrate used */
+    int table;       /* allocation table, index in ff_mpa_alloc_tables */
+    int psy_model;
+    int sample_fmt;  /* of MPA_encode_frame_data() and MPA_encode_frames_data() */
+    const struct PsyTables *psy; /* of the sample rate, shared */
+    MPAFrame *frame; /* frame being encoded, during the encoding calls only */
+    int nb_in_channels;  /* of the input, mixed down to nb_channels if do_downmix */
+    int do_downmix;
+    MPADownmix downmix[MPA_MAX_CHANNELS];
+    const struct ResampleTables *rs; /* NULL without input_rate */
+    int64_t rs_out;  /* output samples of the frames analysed since the start */
+    struct MPAFifo *fifo; /* of MPA_encode_push(), NULL until then */
+#if ENCODE_STATS
+    int stats_enabled;
+    MPAEncodeStats stats;
+#endif
+    /* the context is allocated up to the channels used, see
+       MPA_get_priv_data_size() */
+    MPAChannelState chan[MPA_MAX_CHANNELS];
 } MpegAudioContext;
 
+const int MPA_priv_data_size = sizeof(MpegAudioContext);
+
+int MPA_get_priv_data_size(int channels)
+{
+    if (channels < 1 || channels > MPA_MAX_CHANNELS)
+        return AVERROR(EINVAL);
+    return offsetof(MpegAudioContext, chan) + channels * sizeof(MPAChannelState);
+}
+
+/* the kernels which have SIMD versions, selected at init (see MPAKernels);
+   all the versions give the same results */
+/* loads the 32 samples of channel ch of a filter block, at src in the
+   interleaved samples or in the plane of ch, converted to 16 bits and
+   most recent first, in buf[31] down to buf[0] */
+typedef void (*LoadSamplesFunc)(short *buf, const uint8_t *src, int ch);
+
+/* converts n samples of channel ch at src to 16 bits, in order; used
+   by the resampler which does not read whole blocks */
+typedef void (*ConvertSamplesFunc)(short *dst, const uint8_t *src, int ch, int n);
+
+/* converts n samples at src, stride bytes apart, to 16 bits, in order;
+   used by the downmix, for any number of input channels */
+typedef void (*ConvertChannelFunc)(short *dst, const uint8_t *src, int stride, int n);
+
+/* cursor in the input samples, see input_init(); the filter bank moves
+   it on as it reads the samples */
+typedef struct MPAInput {
+    LoadSamplesFunc load;
+    ConvertSamplesFunc convert;
+    ConvertChannelFunc convert_channel;
+    const uint8_t *data[MPA_MAX_INPUT_CHANNELS]; /* plane of each input channel, or interleaved */
+    size_t pos[MPA_MAX_CHANNELS];  /* samples read for each channel */
+    int sample_size;               /* bytes from a sample to the next of the channel */
+    int channel_size;              /* bytes from a channel to the next, 0 if planar */
+} MPAInput;
+
+typedef struct MPADSPContext {
+    int kernels;
+    int idct_lanes;
+    /* idct32() of nb_blocks <= idct_lanes blocks, interleaved */
+    void (*idct32)(int *out, const int *in, int nb_blocks);
+    void (*filter)(MpegAudioContext *s, int ch, MPAInput *in);
+    void (*compute_max_abs)(int vmax[3][SBLIMIT], int sb_samples[3][12][SBLIMIT]);
+    void (*quantize)(int q[3][12][SBLIMIT], int sb_samples[3][12][SBLIMIT],
+                     unsigned char scale_factors[SBLIMIT][3], const int steps[SBLIMIT]);
+    /* per MPASampleFormat and number of channels - 1 */
+    const LoadSamplesFunc (*load_samples)[MPA_MAX_CHANNELS];
+    /* 32 output samples of the resampler, most recent first: buf[31 - j]
+       from the taps samples of x + offsets[j] and coefs[j] */
+    void (*resample)(short *buf, const short *x, const int16_t * const coefs[32],
+                     const int offsets[32], int taps);
+    /* 32 samples of a channel from nb rows of input samples, in order:
+       dst[j] from x[k][j] with the Q14 gains coefs[k] */
+    void (*downmix)(short *dst, const short (*x)[32], const short *coefs, int nb);
+} MPADSPContext;
+
+static int dsp_init(AVCodecContext *avctx);
+
+/* compute_bit_allocation() and encode_frame() specialised for a number
+   of channels and an allocation table, see set_bitrate() */
+typedef struct MPAFrameFuncs {
+    int (*bit_allocation)(MpegAudioContext *s,
+                          short smr[MPA_MAX_CHANNELS][SBLIMIT],
+                          unsigned char bit_alloc[MPA_MAX_CHANNELS][SBLIMIT],
+                          int max_frame_size, int bound, int target,
+                          int *curve, int *padding);
+    void (*encode)(MpegAudioContext *s,
+                   unsigned char bit_alloc[MPA_MAX_CHANNELS][SBLIMIT], int padding);
+} MPAFrameFuncs;
+
+static const MPAFrameFuncs frame_funcs[MPA_MAX_CHANNELS][5];
+
 
 #if !USE_FLOATS
 #define P 15
 #endif
 
 #if TABLE_GENERATE
-#include <math.h>
 static int16_t s_filter_bank[512];
 static int s_scale_factor_table[64];
 static unsigned char s_scale_diff_table[128];
@@ -616,84 +836,18 @@ int ff_mpa_l2_select_table(int bitrate, int nb_channels, int freq, int lsf)
     return table;
 }
 
-int MPA_encode_init(AVCodecContext *avctx)
-{
-    MpegAudioContext *s = avctx->priv_data;
-    int freq = avctx->sample_rate;
-    int bitrate = avctx->bit_rate;
-    int channels = avctx->channels;
-    int i, table;
-
-    if (channels <= 0 || channels > 2){
-        av_log(avctx, AV_LOG_ERROR, "encoding %d channel(s) is not allowed in mp2\n", channels);
-        return AVERROR(EINVAL);
-    }
-    bitrate = bitrate / 1000;
-    s->nb_channels = channels;
-    avctx->frame_size = MPA_FRAME_SIZE;
-    avctx->initial_padding = 512 - 32 + 1;
-
-    /* encoding freq */
-    s->lsf = 0;
-    for(i=0;i<3;i++) {
-        if (avpriv_mpa_freq_tab[i] == freq)
-            break;
-        if ((avpriv_mpa_freq_tab[i] / 2) == freq) {
-            s->lsf = 1;
-            break;
-        }
-    }
-    if (i == 3){
-        av_log(avctx, AV_LOG_ERROR, "Sampling rate %d is not allowed in mp2\n", freq);
-        return AVERROR(EINVAL);
-    }
-    s->freq_index = i;
-
-    /* encoding bitrate & frequency */
-    for(i=1;i<15;i++) {
-        if (avpriv_mpa_bitrate_tab[s->lsf][1][i] == bitrate)
-            break;
-    }
-    if (i == 15 && !avctx->bit_rate) {
-        i = 14;
-        bitrate = avpriv_mpa_bitrate_tab[s->lsf][1][i];
-        avctx->bit_rate = bitrate * 1000;
-    }
-    if (i == 15){
-        av_log(avctx, AV_LOG_ERROR, "bitrate %d is not allowed in mp2\n", bitrate);
-        return AVERROR(EINVAL);
-    }
-    s->bitrate_index = i;
-#if FRAC_PADDING
-    /* compute total header size & pad bit */
-#define PADDING_FRAC    65536UL
-    //float a = (float)(bitrate * 1000 * MPA_FRAME_SIZE) / (freq * 8.0);
-    //s->frame_size = ((int)a) * 8;
-    //double floor(double x);
-    ///* frame fractional size to compute padding */
-    //s->frame_frac = 0;
-    //s->frame_frac_incr = (int)((a - floor(a)) * PADDING_FRAC);
-
-    unsigned int fb = bitrate * 1000 * MPA_FRAME_SIZE / 8;
-    s->frame_size = (fb / freq) * 8; //  8bit alignment
-    s->frame_frac_incr = ((fb - s->frame_size / 8 * freq) * PADDING_FRAC + freq/2) / freq;
+#if TABLE_GENERATE
+/* the tables are shared by all the contexts, so they are only built once */
+#if HAVE_PTHREADS
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
 #else
-    s->frame_size = (bitrate * 1000 / 8 * MPA_FRAME_SIZE / freq) * 8; //  8bit alignment
+static int tables_ready;
 #endif
-    /* select the right allocation table */
-    table = ff_mpa_l2_select_table(bitrate, s->nb_channels, freq, s->lsf);
 
-    /* number of used subbands */
-    s->sblimit = ff_mpa_sblimit_table[table];
-    s->alloc_table = ff_mpa_alloc_tables[table];
-#if FRAC_PADDING
-    ff_dlog(avctx, "%d kb/s, %d Hz, frame_size=%d bits, table=%d, padincr=%x\n",
-            bitrate, freq, s->frame_size, table, s->frame_frac_incr);
-#endif
-    for(i=0;i<s->nb_channels;i++)
-        s->samples_offset[i] = 0;
-#if TABLE_GENERATE
-    int v;
+static av_cold void mpa_init_tables(void)
+{
+    int i, v;
+
     for(i=0;i<257;i++) {
         v = ff_mpa_enwindow[i];
 #if WFRAC_BITS != 16
@@ -721,7 +875,7 @@ int MPA_encode_init(AVCodecContext *avctx)
             v = 1;
         s_scale_factor_table[i] = v;
 #if USE_FLOATS
-        s->scale_factor_inv_table[i] = exp2(-(3 - i) / 3.0) / (float)(1 << 20);
+        s_scale_factor_inv_table[i] = exp2(-(3 - i) / 3.0) / (float)(1 << 20);
 #else
         s_scale_factor_shift[i] = 21 - P - (i / 3);
         s_scale_factor_mult[i] = (1 << P) * exp2((i % 3) / 3.0);
@@ -796,108 +950,655 @@ int MPA_encode_init(AVCodecContext *avctx)
     }
     printf("\n};\n\n");
 #endif
-#endif
-    return 0;
 }
+#endif
 
-/* 32 point floating point IDCT without 1/sqrt(2) coef zero scaling */
-static void idct32(int *out, int *tab)
-{
-    int i, j;
-    int *t, *t1, xr;
-    const int *xp = costab32;
-
-    for(j=31;j>=3;j-=2) tab[j] += tab[j - 2];
+/* Allocation tables of ff_mpa_alloc_tables unpacked per subband and
+   per allocation step b, to be indexed directly by the allocation and
+   the packing. Step 0 codes nothing. The arrays are whole cache lines. */
+typedef struct AllocDesc {
+    unsigned char bits[SBLIMIT];              /* size of the allocation field */
+    unsigned char max_step[SBLIMIT];          /* largest step, (1 << bits) - 1 */
+    unsigned char group_bits[16][SBLIMIT];    /* bits of a group of 3 samples */
+    signed char quant_bits[16][SBLIMIT];      /* ff_mpa_quant_bits */
+    int steps[16][SBLIMIT];                   /* ff_mpa_quant_steps */
+    unsigned short incr[16][SBLIMIT];         /* bits over step b - 1, scale factors aside */
+    unsigned short snr[16][SBLIMIT];          /* quant_snr */
+} AllocDesc;
+
+/* one per table of ff_mpa_sblimit_table, shared by all the contexts */
+DECLARE_ALIGNED(64, static AllocDesc, alloc_desc)[5];
+
+#if HAVE_PTHREADS
+static pthread_once_t alloc_desc_once = PTHREAD_ONCE_INIT;
+#else
+static int alloc_desc_ready;
+#endif
 
-    t = tab + 30;
-    t1 = tab + 2;
-    do {
-        t[0] += t[-4];
-        t[1] += t[1 - 4];
-        t -= 4;
-    } while (t != t1);
+static av_cold void alloc_desc_init(void)
+{
+    const unsigned char *alloc;
+    AllocDesc *d;
+    int table, i, b, q;
+
+    for(table=0;table<5;table++) {
+        d = &alloc_desc[table];
+        alloc = ff_mpa_alloc_tables[table];
+        for(i=0;i<ff_mpa_sblimit_table[table];i++) {
+            d->bits[i] = alloc[0];
+            d->max_step[i] = (1 << alloc[0]) - 1;
+            for(b=1;b<=d->max_step[i];b++) {
+                q = alloc[b];
+                d->group_bits[b][i] = s_total_quant_bits[q] / 12;
+                d->quant_bits[b][i] = ff_mpa_quant_bits[q];
+                d->steps[b][i] = ff_mpa_quant_steps[q];
+                d->incr[b][i] = s_total_quant_bits[q] -
+                                (b > 1 ? s_total_quant_bits[alloc[b - 1]] : 0);
+                d->snr[b][i] = quant_snr[q];
+            }
+            alloc += 1 << alloc[0];
+        }
+    }
+}
 
-    t = tab + 28;
-    t1 = tab + 4;
-    do {
-        t[0] += t[-8];
-        t[1] += t[1-8];
-        t[2] += t[2-8];
-        t[3] += t[3-8];
-        t -= 8;
-    } while (t != t1);
+/* tables of the psycho acoustic model */
+static float psy_window[PSY_FFT_SIZE];
+static float psy_cos[PSY_FFT_SIZE / 2], psy_sin[PSY_FFT_SIZE / 2];
+static float psy_scf_power[64];
 
-    t = tab;
-    t1 = tab + 32;
-    do {
-        t[ 3] = -t[ 3];
-        t[ 6] = -t[ 6];
+/* the tables which depend on the sample rate */
+typedef struct PsyTables {
+    int nb_grid;
+    float ath[PSY_GRID_SIZE];                  /* threshold in quiet on the grid */
+    unsigned char bin_grid[PSY_FFT_SIZE / 2];  /* grid point of each FFT bin */
+    unsigned char sb_grid[SBLIMIT][2];         /* grid points covered by each subband */
+} PsyTables;
 
-        t[11] = -t[11];
-        t[12] = -t[12];
-        t[13] = -t[13];
-        t[15] = -t[15];
-        t += 16;
-    } while (t != t1);
+/* per [lsf][freq_index], shared by all the contexts */
+static PsyTables psy_rate_tables[2][3];
 
+#if HAVE_PTHREADS
+static pthread_once_t psy_tables_once = PTHREAD_ONCE_INIT;
+#else
+static int psy_tables_ready;
+#endif
 
-    t = tab;
-    t1 = tab + 8;
-    do {
-        int x1, x2, x3, x4;
+static float psy_bark(float f)
+{
+    return 13 * atanf(0.00076f * f) + 3.5f * atanf((f / 7500) * (f / 7500));
+}
 
-        x3 = MUL(t[16], FIX(M_SQRT2*0.5));
-        x4 = t[0] - x3;
-        x3 = t[0] + x3;
+/* threshold in quiet, in dB, f in Hz */
+static float psy_ath_db(float f)
+{
+    f = FFMAX(f, 20) * 0.001f;
+    return 3.64f * powf(f, -0.8f) - 6.5f * expf(-0.6f * (f - 3.3f) * (f - 3.3f)) +
+           0.001f * f * f * f * f;
+}
 
-        x2 = MUL(-(t[24] + t[8]), FIX(M_SQRT2*0.5));
-        x1 = MUL((t[8] - x2), xp[0]);
-        x2 = MUL((t[8] + x2), xp[1]);
+static av_cold void psy_init_rate(PsyTables *p, int freq)
+{
+    int i, g, first, last, nb_grid;
+    float lo, hi, f;
+
+    nb_grid = FFMIN((int)(psy_bark(freq * 0.5f) * PSY_GRID_STEPS) + 1, PSY_GRID_SIZE);
+    p->nb_grid = nb_grid;
+    for(g=0;g<nb_grid;g++) {
+        /* frequency of the grid point */
+        lo = 0;
+        hi = freq * 0.5f;
+        for(i=0;i<24;i++) {
+            f = (lo + hi) * 0.5f;
+            if (psy_bark(f) * PSY_GRID_STEPS < g)
+                lo = f;
+            else
+                hi = f;
+        }
+        p->ath[g] = powf(10, (psy_ath_db(lo) - 96) * 0.1f);
+    }
+    for(i=0;i<PSY_FFT_SIZE/2;i++) {
+        g = (int)(psy_bark((float)i * freq / PSY_FFT_SIZE) * PSY_GRID_STEPS + 0.5f);
+        p->bin_grid[i] = FFMIN(g, nb_grid - 1);
+    }
+    for(i=0;i<SBLIMIT;i++) {
+        lo = psy_bark(i * freq / 64.0f) * PSY_GRID_STEPS;
+        hi = psy_bark((i + 1) * freq / 64.0f) * PSY_GRID_STEPS;
+        first = (int)ceilf(lo);
+        last = FFMIN((int)hi, nb_grid - 1);
+        if (first > last) {
+            /* narrower than a grid step */
+            first = last = FFMIN((int)((lo + hi) * 0.5f + 0.5f), nb_grid - 1);
+        }
+        p->sb_grid[i][0] = first;
+        p->sb_grid[i][1] = last;
+    }
+}
 
-        t[ 0] = x3 + x1;
-        t[ 8] = x4 - x2;
-        t[16] = x4 + x2;
-        t[24] = x3 - x1;
-        t++;
-    } while (t != t1);
+static av_cold void psy_init_tables(void)
+{
+    int i, lsf;
+
+    /* Hann window with the gain of model 1, which also scales the samples
+       to +-1 and the transform by 1/N: a full scale sine is at 0 dB, or
+       the 96 dB of the model */
+    for(i=0;i<PSY_FFT_SIZE;i++)
+        psy_window[i] = sqrt(8.0 / 3.0) * 0.5 * (1 - cos(2 * M_PI * i / PSY_FFT_SIZE)) /
+                        (32768.0 * PSY_FFT_SIZE);
+    for(i=0;i<PSY_FFT_SIZE/2;i++) {
+        psy_cos[i] = cos(2 * M_PI * i / PSY_FFT_SIZE);
+        psy_sin[i] = sin(2 * M_PI * i / PSY_FFT_SIZE);
+    }
+    /* level of a subband from its scale factor: 20 * log10(scf * 32768) - 10 dB */
+    for(i=0;i<64;i++)
+        psy_scf_power[i] = pow(10, (20 * log10(2.0 * 32768 * pow(2, -i / 3.0)) - 10 - 96) / 10);
+    for(lsf=0;lsf<2;lsf++) {
+        for(i=0;i<3;i++)
+            psy_init_rate(&psy_rate_tables[lsf][i], avpriv_mpa_freq_tab[i] >> lsf);
+    }
+}
 
-    xp += 2;
-    t = tab;
-    t1 = tab + 4;
-    do {
-        xr = MUL(t[28],xp[0]);
-        t[28] = (t[0] - xr);
-        t[0] = (t[0] + xr);
+static av_cold void psy_init(MpegAudioContext *s)
+{
+#if HAVE_PTHREADS
+    pthread_once(&psy_tables_once, psy_init_tables);
+#else
+    if (!psy_tables_ready) {
+        psy_init_tables();
+        psy_tables_ready = 1;
+    }
+#endif
+    s->psy = &psy_rate_tables[s->lsf][s->freq_index];
+}
 
-        xr = MUL(t[4],xp[1]);
-        t[ 4] = (t[24] - xr);
-        t[24] = (t[24] + xr);
+/*
+ * Resampler. Output sample k is at input position k * step / phases,
+ * between input samples n and n + 1 at phase p of phases. It is the dot
+ * product of the taps input samples from n - taps / 2 + 1 with the
+ * coefficients of phase p, which are Q15 and add up to 1 in every phase.
+ * The input is read as the filter bank needs the output, so it is
+ * converted and resampled on the way to samples_buf.
+ */
+typedef struct ResampleTables {
+    int in_rate, out_rate;
+    int phases, step;    /* output and input rates over their gcd */
+    int taps;            /* multiple of 16 */
+    int16_t *coefs;      /* phases x taps */
+} ResampleTables;
+
+static ResampleTables resample_tables[RS_MAX_TABLES];
+static int nb_resample_tables;
+#if HAVE_PTHREADS
+static pthread_mutex_t resample_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-        xr = MUL(t[20],xp[2]);
-        t[20] = (t[8] - xr);
-        t[ 8] = (t[8] + xr);
+static double bessel_i0(double x)
+{
+    double sum = 1, term = 1;
+    int k;
 
-        xr = MUL(t[12],xp[3]);
-        t[12] = (t[16] - xr);
-        t[16] = (t[16] + xr);
-        t++;
-    } while (t != t1);
-    xp += 4;
+    for(k=1;k<50;k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+    return sum;
+}
 
-    for (i = 0; i < 4; i++) {
-        xr = MUL(tab[30-i*4],xp[0]);
-        tab[30-i*4] = (tab[i*4] - xr);
-        tab[   i*4] = (tab[i*4] + xr);
+static av_cold int resample_build(ResampleTables *rs)
+{
+    double ratio = (double)rs->in_rate / rs->out_rate;
+    /* cutoff in cycles per input sample */
+    double c = 0.5 * RS_CUTOFF / FFMAX(ratio, 1.0);
+    double h[RS_MAX_TAPS], sum, d, w;
+    int p, i, half, total, center;
+
+    rs->taps = ((int)ceil(2 * RS_ZERO_CROSSINGS * FFMAX(ratio, 1.0)) + 15) & ~15;
+    half = rs->taps / 2;
+    rs->coefs = malloc((size_t)rs->phases * rs->taps * sizeof(*rs->coefs));
+    if (!rs->coefs)
+        return AVERROR(ENOMEM);
+    for(p=0;p<rs->phases;p++) {
+        int16_t *coefs = rs->coefs + p * rs->taps;
+        sum = 0;
+        for(i=0;i<rs->taps;i++) {
+            d = i - half + 1 - (double)p / rs->phases;
+            w = 1 - (d / half) * (d / half);
+            w = w > 0 ? bessel_i0(RS_KAISER_BETA * sqrt(w)) / bessel_i0(RS_KAISER_BETA) : 0;
+            h[i] = d == 0 ? 2 * c : sin(2 * M_PI * c * d) / (M_PI * d);
+            h[i] *= w;
+            sum += h[i];
+        }
+        /* unity gain in every phase, after rounding */
+        total = 0;
+        center = half - 1;
+        for(i=0;i<rs->taps;i++) {
+            coefs[i] = (int16_t)lrint(h[i] / sum * 32768);
+            total += coefs[i];
+            if (h[i] > h[center])
+                center = i;
+        }
+        coefs[center] += 32768 - total;
+    }
+    return 0;
+}
 
-        xr = MUL(tab[ 2+i*4],xp[1]);
-        tab[ 2+i*4] = (tab[28-i*4] - xr);
-        tab[28-i*4] = (tab[28-i*4] + xr);
+static int64_t gcd64(int64_t a, int64_t b)
+{
+    while (b) {
+        int64_t r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
 
-        xr = MUL(tab[31-i*4],xp[0]);
-        tab[31-i*4] = (tab[1+i*4] - xr);
-        tab[ 1+i*4] = (tab[1+i*4] + xr);
+/* the shared tables from in_rate to out_rate, checked by the caller */
+static av_cold int resample_init(MpegAudioContext *s, int in_rate, int out_rate)
+{
+    ResampleTables *rs = NULL;
+    int i, ret = 0;
 
-        xr = MUL(tab[ 3+i*4],xp[1]);
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&resample_tables_lock);
+#endif
+    for(i=0;i<nb_resample_tables;i++) {
+        if (resample_tables[i].in_rate == in_rate && resample_tables[i].out_rate == out_rate)
+            rs = &resample_tables[i];
+    }
+    if (!rs) {
+        if (nb_resample_tables == RS_MAX_TABLES) {
+            ret = AVERROR(ENOMEM);
+        } else {
+            int g = (int)gcd64(in_rate, out_rate);
+            rs = &resample_tables[nb_resample_tables];
+            rs->in_rate = in_rate;
+            rs->out_rate = out_rate;
+            rs->phases = out_rate / g;
+            rs->step = in_rate / g;
+            ret = resample_build(rs);
+            if (ret >= 0)
+                nb_resample_tables++;
+        }
+    }
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&resample_tables_lock);
+#endif
+    if (ret < 0)
+        return ret;
+    s->rs = rs;
+    s->rs_out = 0;
+    return 0;
+}
+
+/* stereo gains of the input channels in WAVE order, see MPA_MAX_INPUT_CHANNELS */
+static const float downmix_default[MPA_MAX_INPUT_CHANNELS][2] = {
+    { 1, 0 }, { 0, 1 }, { M_SQRT1_2, M_SQRT1_2 }, { 0, 0 },
+    { M_SQRT1_2, 0 }, { 0, M_SQRT1_2 }, { M_SQRT1_2, 0 }, { 0, M_SQRT1_2 },
+};
+
+static av_cold int downmix_init(AVCodecContext *avctx, MpegAudioContext *s)
+{
+    float m[MPA_MAX_CHANNELS][MPA_MAX_INPUT_CHANNELS];
+    int nin = avctx->input_channels ? avctx->input_channels : s->nb_channels;
+    float sum, max_sum = 0;
+    int ch, i;
+
+    if (nin < 1 || nin > MPA_MAX_INPUT_CHANNELS) {
+        av_log(avctx, AV_LOG_ERROR, "%d input channels are not supported\n", nin);
+        return AVERROR(EINVAL);
+    }
+    s->nb_in_channels = nin;
+    s->do_downmix = avctx->downmix_matrix || nin != s->nb_channels;
+    if (!s->do_downmix)
+        return 0;
+
+    for(ch=0;ch<s->nb_channels;ch++) {
+        for(i=0;i<nin;i++) {
+            if (avctx->downmix_matrix)
+                m[ch][i] = avctx->downmix_matrix[ch * nin + i];
+            else if (nin == 1)
+                m[ch][i] = 1;
+            else if (s->nb_channels == 1)
+                m[ch][i] = (downmix_default[i][0] + downmix_default[i][1]) / 2;
+            else
+                m[ch][i] = downmix_default[i][ch];
+        }
+    }
+    for(ch=0;ch<s->nb_channels;ch++) {
+        sum = 0;
+        for(i=0;i<nin;i++)
+            sum += fabsf(m[ch][i]);
+        /* also rejects NaNs */
+        if (avctx->downmix_matrix && !(sum <= 2)) {
+            av_log(avctx, AV_LOG_ERROR, "downmix gains of channel %d add up to more than 2\n", ch);
+            return AVERROR(EINVAL);
+        }
+        max_sum = FFMAX(max_sum, sum);
+    }
+
+    /* the mix of the default gains cannot clip */
+    if (!avctx->downmix_matrix && max_sum > 1) {
+        for(ch=0;ch<s->nb_channels;ch++)
+            for(i=0;i<nin;i++)
+                m[ch][i] /= max_sum;
+    }
+
+    /* only the input channels used, with the gains in Q14 */
+    for(ch=0;ch<s->nb_channels;ch++) {
+        MPADownmix *d = &s->downmix[ch];
+        d->nb = 0;
+        for(i=0;i<nin;i++) {
+            int c = av_clip_int16(lrintf(m[ch][i] * 16384));
+            if (c) {
+                d->in[d->nb] = i;
+                d->coefs[d->nb++] = c;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Layer II leaves out the bitrates too low for two channels and too
+   high for one, except at the low sampling rates */
+static int bitrate_allowed(int lsf, int nb_channels, int bitrate)
+{
+    if (lsf)
+        return 1;
+    if (nb_channels == 1)
+        return bitrate <= 192;
+    return bitrate >= 64 && bitrate != 80;
+}
+
+/* frame size in bits of a bitrate index, without padding */
+static int frame_bits(MpegAudioContext *s, int index)
+{
+    int freq = avpriv_mpa_freq_tab[s->freq_index] >> s->lsf;
+
+    return (avpriv_mpa_bitrate_tab[s->lsf][1][index] * 1000 / 8 * MPA_FRAME_SIZE / freq) * 8;
+}
+
+/* select the bitrate of the next frames and its allocation table */
+static void set_bitrate(MpegAudioContext *s, int index)
+{
+    int freq = avpriv_mpa_freq_tab[s->freq_index] >> s->lsf;
+
+    s->bitrate_index = index;
+    s->frame_size = frame_bits(s, index);
+    s->table = ff_mpa_l2_select_table(avpriv_mpa_bitrate_tab[s->lsf][1][index],
+                                      s->nb_channels, freq, s->lsf);
+    /* number of used subbands */
+    s->sblimit = ff_mpa_sblimit_table[s->table];
+    s->funcs = &frame_funcs[s->nb_channels - 1][s->table];
+}
+
+int MPA_encode_init(AVCodecContext *avctx)
+{
+    MpegAudioContext *s = avctx->priv_data;
+    int freq = avctx->sample_rate;
+    int bitrate = avctx->bit_rate;
+    int channels = avctx->channels;
+    int i, ret;
+
+    if (channels <= 0 || channels > 2){
+        av_log(avctx, AV_LOG_ERROR, "encoding %d channel(s) is not allowed in mp2\n", channels);
+        return AVERROR(EINVAL);
+    }
+    bitrate = bitrate / 1000;
+    s->nb_channels = channels;
+    avctx->frame_size = MPA_FRAME_SIZE;
+    avctx->initial_padding = 512 - 32 + 1;
+
+    /* encoding freq */
+    s->lsf = 0;
+    for(i=0;i<3;i++) {
+        if (avpriv_mpa_freq_tab[i] == freq)
+            break;
+        if ((avpriv_mpa_freq_tab[i] / 2) == freq) {
+            s->lsf = 1;
+            break;
+        }
+    }
+    if (i == 3){
+        av_log(avctx, AV_LOG_ERROR, "Sampling rate %d is not allowed in mp2\n", freq);
+        return AVERROR(EINVAL);
+    }
+    s->freq_index = i;
+
+    if (avctx->rc_mode < 0 || avctx->rc_mode >= MPA_RC_NB) {
+        av_log(avctx, AV_LOG_ERROR, "rate control mode %d does not exist\n", avctx->rc_mode);
+        return AVERROR(EINVAL);
+    }
+    s->rc_mode = avctx->rc_mode;
+    if ((ret = dsp_init(avctx)) < 0)
+        return ret;
+
+    /* encoding bitrate & frequency */
+    if (s->rc_mode == MPA_RC_CBR) {
+        for(i=1;i<15;i++) {
+            if (avpriv_mpa_bitrate_tab[s->lsf][1][i] == bitrate)
+                break;
+        }
+        if (i == 15 && !avctx->bit_rate) {
+            i = 14;
+            bitrate = avpriv_mpa_bitrate_tab[s->lsf][1][i];
+            avctx->bit_rate = bitrate * 1000;
+        }
+        if (i == 15){
+            av_log(avctx, AV_LOG_ERROR, "bitrate %d is not allowed in mp2\n", bitrate);
+            return AVERROR(EINVAL);
+        }
+        s->bitrates[0] = i;
+        s->nb_bitrates = 1;
+    } else {
+        s->nb_bitrates = 0;
+        for(i=1;i<15;i++) {
+            if (bitrate_allowed(s->lsf, channels, avpriv_mpa_bitrate_tab[s->lsf][1][i]))
+                s->bitrates[s->nb_bitrates++] = i;
+        }
+        if (s->rc_mode == MPA_RC_ABR &&
+            (bitrate < avpriv_mpa_bitrate_tab[s->lsf][1][s->bitrates[0]] ||
+             bitrate > avpriv_mpa_bitrate_tab[s->lsf][1][s->bitrates[s->nb_bitrates - 1]])) {
+            av_log(avctx, AV_LOG_ERROR, "mean bitrate %d is out of the range of mp2\n", bitrate);
+            return AVERROR(EINVAL);
+        }
+        if (avctx->vbr_quality * 10 < -RC_NMR_MAX || avctx->vbr_quality * 10 > RC_NMR_MAX) {
+            av_log(avctx, AV_LOG_ERROR, "vbr quality %d is out of range\n", avctx->vbr_quality);
+            return AVERROR(EINVAL);
+        }
+        s->rc_target = avctx->vbr_quality * 10;
+        s->rc_frame_bits = (int)((int64_t)avctx->bit_rate * MPA_FRAME_SIZE / freq);
+        s->rc_reservoir = 0;
+        bitrate = avpriv_mpa_bitrate_tab[s->lsf][1][s->bitrates[s->nb_bitrates - 1]];
+    }
+    if (avctx->psy_model < 0 || avctx->psy_model >= MPA_PSY_NB) {
+        av_log(avctx, AV_LOG_ERROR, "psycho acoustic model %d does not exist\n", avctx->psy_model);
+        return AVERROR(EINVAL);
+    }
+    s->psy_model = avctx->psy_model;
+    if (avctx->stereo_mode != MPA_STEREO && avctx->stereo_mode != MPA_JSTEREO) {
+        av_log(avctx, AV_LOG_ERROR, "stereo mode %d is not supported\n", avctx->stereo_mode);
+        return AVERROR(EINVAL);
+    }
+    s->joint_stereo = channels == 2 && avctx->stereo_mode == MPA_JSTEREO;
+    if (avctx->sample_fmt < 0 || avctx->sample_fmt >= MPA_SAMPLE_FMT_NB) {
+        av_log(avctx, AV_LOG_ERROR, "sample format %d is not supported\n", avctx->sample_fmt);
+        return AVERROR(EINVAL);
+    }
+    s->sample_fmt = avctx->sample_fmt;
+    if ((ret = downmix_init(avctx, s)) < 0)
+        return ret;
+    s->rs = NULL;
+    if (avctx->input_rate && avctx->input_rate != freq) {
+        if (avctx->input_rate < 0 || avctx->input_rate > RS_MAX_RATIO * freq ||
+            freq / gcd64(avctx->input_rate, freq) > RS_MAX_PHASES) {
+            av_log(avctx, AV_LOG_ERROR, "input rate %d cannot be resampled to %d\n",
+                   avctx->input_rate, freq);
+            return AVERROR(EINVAL);
+        }
+        if ((ret = resample_init(s, avctx->input_rate, freq)) < 0)
+            return ret;
+    }
+#if FRAC_PADDING
+    /* compute total header size & pad bit */
+#define PADDING_FRAC    65536UL
+    //float a = (float)(bitrate * 1000 * MPA_FRAME_SIZE) / (freq * 8.0);
+    //s->frame_size = ((int)a) * 8;
+    //double floor(double x);
+    ///* frame fractional size to compute padding */
+    //s->frame_frac = 0;
+    //s->frame_frac_incr = (int)((a - floor(a)) * PADDING_FRAC);
+
+    unsigned int fb = bitrate * 1000 * MPA_FRAME_SIZE / 8;
+    s->frame_size = (fb / freq) * 8; //  8bit alignment
+    s->frame_frac_incr = ((fb - s->frame_size / 8 * freq) * PADDING_FRAC + freq/2) / freq;
+#else
+    s->frame_size = (bitrate * 1000 / 8 * MPA_FRAME_SIZE / freq) * 8; //  8bit alignment
+#endif
+    /* the header fields are constant for the stream, except the bitrate,
+       the padding bit and for joint stereo the mode, which are set per frame */
+    s->header = (0xfffU << 20) |                 /* sync */
+                ((1 - s->lsf) << 19) |           /* 1 = MPEG-1 ID, 0 = MPEG-2 lsf ID */
+                ((4 - 2) << 17) |                /* layer 2 */
+                (1 << 16) |                      /* no error protection */
+                (s->freq_index << 10) |
+                ((s->nb_channels == 2 ? MPA_STEREO : MPA_MONO) << 6) |
+                (1 << 2);                        /* original */
+
+    /* the analysis covers the subbands of every bitrate used, the
+       allocation table is selected with the bitrate of each frame */
+    s->max_sblimit = 0;
+    for(i=0;i<s->nb_bitrates;i++) {
+        set_bitrate(s, s->bitrates[i]);
+        s->max_sblimit = FFMAX(s->max_sblimit, s->sblimit);
+    }
+    s->jsbound = s->sblimit;
+#if FRAC_PADDING
+    ff_dlog(avctx, "%d kb/s, %d Hz, frame_size=%d bits, sblimit=%d, padincr=%x\n",
+            bitrate, freq, s->frame_size, s->sblimit, s->frame_frac_incr);
+#endif
+    if (s->psy_model != MPA_PSY_FIXED)
+        psy_init(s);
+#if TABLE_GENERATE
+#if HAVE_PTHREADS
+    pthread_once(&tables_once, mpa_init_tables);
+#else
+    if (!tables_ready) {
+        mpa_init_tables();
+        tables_ready = 1;
+    }
+#endif
+#endif
+    /* after mpa_init_tables(), for s_total_quant_bits */
+#if HAVE_PTHREADS
+    pthread_once(&alloc_desc_once, alloc_desc_init);
+#else
+    if (!alloc_desc_ready) {
+        alloc_desc_init();
+        alloc_desc_ready = 1;
+    }
+#endif
+    return 0;
+}
+
+/* 32 point floating point IDCT without 1/sqrt(2) coef zero scaling */
+static av_unused void idct32(int *out, int *tab)
+{
+    int i, j;
+    int *t, *t1, xr;
+    const int *xp = costab32;
+
+    for(j=31;j>=3;j-=2) tab[j] += tab[j - 2];
+
+    t = tab + 30;
+    t1 = tab + 2;
+    do {
+        t[0] += t[-4];
+        t[1] += t[1 - 4];
+        t -= 4;
+    } while (t != t1);
+
+    t = tab + 28;
+    t1 = tab + 4;
+    do {
+        t[0] += t[-8];
+        t[1] += t[1-8];
+        t[2] += t[2-8];
+        t[3] += t[3-8];
+        t -= 8;
+    } while (t != t1);
+
+    t = tab;
+    t1 = tab + 32;
+    do {
+        t[ 3] = -t[ 3];
+        t[ 6] = -t[ 6];
+
+        t[11] = -t[11];
+        t[12] = -t[12];
+        t[13] = -t[13];
+        t[15] = -t[15];
+        t += 16;
+    } while (t != t1);
+
+
+    t = tab;
+    t1 = tab + 8;
+    do {
+        int x1, x2, x3, x4;
+
+        x3 = MUL(t[16], FIX(M_SQRT2*0.5));
+        x4 = t[0] - x3;
+        x3 = t[0] + x3;
+
+        x2 = MUL(-(t[24] + t[8]), FIX(M_SQRT2*0.5));
+        x1 = MUL((t[8] - x2), xp[0]);
+        x2 = MUL((t[8] + x2), xp[1]);
+
+        t[ 0] = x3 + x1;
+        t[ 8] = x4 - x2;
+        t[16] = x4 + x2;
+        t[24] = x3 - x1;
+        t++;
+    } while (t != t1);
+
+    xp += 2;
+    t = tab;
+    t1 = tab + 4;
+    do {
+        xr = MUL(t[28],xp[0]);
+        t[28] = (t[0] - xr);
+        t[0] = (t[0] + xr);
+
+        xr = MUL(t[4],xp[1]);
+        t[ 4] = (t[24] - xr);
+        t[24] = (t[24] + xr);
+
+        xr = MUL(t[20],xp[2]);
+        t[20] = (t[8] - xr);
+        t[ 8] = (t[8] + xr);
+
+        xr = MUL(t[12],xp[3]);
+        t[12] = (t[16] - xr);
+        t[16] = (t[16] + xr);
+        t++;
+    } while (t != t1);
+    xp += 4;
+
+    for (i = 0; i < 4; i++) {
+        xr = MUL(tab[30-i*4],xp[0]);
+        tab[30-i*4] = (tab[i*4] - xr);
+        tab[   i*4] = (tab[i*4] + xr);
+
+        xr = MUL(tab[ 2+i*4],xp[1]);
+        tab[ 2+i*4] = (tab[28-i*4] - xr);
+        tab[28-i*4] = (tab[28-i*4] + xr);
+
+        xr = MUL(tab[31-i*4],xp[0]);
+        tab[31-i*4] = (tab[1+i*4] - xr);
+        tab[ 1+i*4] = (tab[1+i*4] + xr);
+
+        xr = MUL(tab[ 3+i*4],xp[1]);
         tab[ 3+i*4] = (tab[29-i*4] - xr);
         tab[29-i*4] = (tab[29-i*4] + xr);
 
@@ -920,100 +1621,881 @@ static void idct32(int *out, int *tab)
     }
 }
 
-#define WSHIFT (WFRAC_BITS + 15 - FRAC_BITS)
-
-static void filter(MpegAudioContext *s, int ch, const short *samples, int incr)
+/*
+ * The same transform on IDCT_LANES blocks at once, one block per vector
+ * lane. MUL() keeps bits FRAC_BITS..FRAC_BITS+31 of the 64 bit product,
+ * which is done with 32x32->64 bit multiplies on the even and odd lanes,
+ * so the output is identical to idct32().
+ */
+#if HAVE_AVX2
+static av_always_inline av_target_avx2 __m256i vmul_avx2(__m256i a, int b)
 {
-    const short *p, *q;
-    int sum, offset, i, j;
-    int tmp[64];
-    int tmp1[32];
-    int *out;
-
-    offset = s->samples_offset[ch];
-    out = &s->sb_samples[ch][0][0][0];
-    for(j=0;j<36;j++) {
-        /* 32 samples at once */
-        for(i=0;i<32;i++) {
-            s->samples_buf[ch][offset + (31 - i)] = samples[0];
-            samples += incr;
-        }
-
-        /* filter */
-        p = s->samples_buf[ch] + offset;
-        q = s_filter_bank;
-        /* maxsum = 23169 */
-        for(i=0;i<64;i++) {
-            sum = p[0*64] * q[0*64];
-            sum += p[1*64] * q[1*64];
-            sum += p[2*64] * q[2*64];
-            sum += p[3*64] * q[3*64];
-            sum += p[4*64] * q[4*64];
-            sum += p[5*64] * q[5*64];
-            sum += p[6*64] * q[6*64];
-            sum += p[7*64] * q[7*64];
-            tmp[i] = sum;
-            p++;
-            q++;
-        }
-        tmp1[0] = tmp[16] >> WSHIFT;
-        for( i=1; i<=16; i++ ) tmp1[i] = (tmp[i+16]+tmp[16-i]) >> WSHIFT;
-        for( i=17; i<=31; i++ ) tmp1[i] = (tmp[i+16]-tmp[80-i]) >> WSHIFT;
+    __m256i c = _mm256_set1_epi32(b);
+    __m256i even = _mm256_srli_epi64(_mm256_mul_epi32(a, c), FRAC_BITS);
+    __m256i odd  = _mm256_srli_epi64(_mm256_mul_epi32(_mm256_srli_epi64(a, 32), c), FRAC_BITS);
+    return _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xaa);
+}
+#endif
+#if HAVE_SSE2
+/* SSE2 only has an unsigned multiply: the product of a negative a is
+   corrected by subtracting b << 32 (all the coefficients are positive) */
+static av_always_inline __m128i vmul_sse2(__m128i a, int b)
+{
+    const __m128i lo = _mm_set_epi32(0, -1, 0, -1);
+    __m128i c = _mm_set1_epi32(b);
+    __m128i neg = _mm_and_si128(_mm_srai_epi32(a, 31), c);
+    __m128i even = _mm_mul_epu32(a, c);
+    __m128i odd  = _mm_mul_epu32(_mm_srli_epi64(a, 32), c);
+    even = _mm_sub_epi64(even, _mm_slli_epi64(neg, 32));
+    odd  = _mm_sub_epi64(odd, _mm_andnot_si128(lo, neg));
+    even = _mm_srli_epi64(even, FRAC_BITS);
+    odd  = _mm_srli_epi64(odd, FRAC_BITS);
+    return _mm_or_si128(_mm_and_si128(even, lo), _mm_slli_epi64(odd, 32));
+}
+#endif
+#if HAVE_NEON
+static av_always_inline int32x4_t vmul_neon(int32x4_t a, int b)
+{
+    int32x2_t c = vdup_n_s32(b);
+    return vcombine_s32(vshrn_n_s64(vmull_s32(vget_low_s32(a),  c), FRAC_BITS),
+                        vshrn_n_s64(vmull_s32(vget_high_s32(a), c), FRAC_BITS));
+}
+#endif
 
-        idct32(out, tmp1);
+/*
+ * Sample loaders, see LoadSamplesFunc. The conversion to 16 bits is
+ * done as the samples are read: 24 bit samples are truncated, float
+ * ones are rounded to nearest and clipped.
+ */
+static const unsigned char sample_fmt_bytes[MPA_SAMPLE_FMT_NB] = { 2, 2, 3, 4 };
+static const unsigned char sample_fmt_planar[MPA_SAMPLE_FMT_NB] = { 0, 0, 0, 1 };
 
-        /* advance of 32 samples */
-        offset -= 32;
-        out += 32;
-        /* handle the wrap around */
-        if (offset < 0) {
-            memmove(s->samples_buf[ch] + SAMPLES_BUF_SIZE - (512 - 32),
-                    s->samples_buf[ch], (512 - 32) * 2);
-            offset = SAMPLES_BUF_SIZE - 512;
-        }
+static av_always_inline int load_sample(const uint8_t *p, int fmt)
+{
+    float f;
+
+    switch (fmt) {
+    case MPA_SAMPLE_FMT_S16BE:
+        return (int16_t)(p[0] << 8 | p[1]);
+    case MPA_SAMPLE_FMT_S24LE:
+        return (int16_t)(p[1] | p[2] << 8);
+    case MPA_SAMPLE_FMT_FLTP:
+        f = *(const float *)p * 32768.0f;
+        return (int)lrintf(FFMAX(FFMIN(f, 32767.0f), -32768.0f));
+    default:
+        return *(const int16_t *)p;
     }
-    s->samples_offset[ch] = offset;
 }
 
-static void compute_scale_factors(MpegAudioContext *s,
-                                  unsigned char scale_code[SBLIMIT],
+static av_always_inline void load_samples_tmpl(short *buf, const uint8_t *src, int ch,
+                                               int fmt, int nb_channels)
+{
+    int size = sample_fmt_bytes[fmt];
+    int i;
+
+    if (sample_fmt_planar[fmt])
+        nb_channels = 1;
+    else
+        src += ch * size;
+    for(i=0;i<32;i++)
+        buf[31 - i] = load_sample(src + i * size * nb_channels, fmt);
+}
+
+#define LOAD_SAMPLES_C(name, fmt, nb_channels)                               \
+static void load_ ## name ## _c(short *buf, const uint8_t *src, int ch)   \
+{                                                                          \
+    load_samples_tmpl(buf, src, ch, fmt, nb_channels);                     \
+}
+
+LOAD_SAMPLES_C(s16_mono,     MPA_SAMPLE_FMT_S16,   1)
+LOAD_SAMPLES_C(s16_stereo,   MPA_SAMPLE_FMT_S16,   2)
+LOAD_SAMPLES_C(s16be_mono,   MPA_SAMPLE_FMT_S16BE, 1)
+LOAD_SAMPLES_C(s16be_stereo, MPA_SAMPLE_FMT_S16BE, 2)
+LOAD_SAMPLES_C(s24le_mono,   MPA_SAMPLE_FMT_S24LE, 1)
+LOAD_SAMPLES_C(s24le_stereo, MPA_SAMPLE_FMT_S24LE, 2)
+LOAD_SAMPLES_C(fltp,         MPA_SAMPLE_FMT_FLTP,  1)
+
+static const LoadSamplesFunc load_samples_c[MPA_SAMPLE_FMT_NB][MPA_MAX_CHANNELS] = {
+    { load_s16_mono_c,   load_s16_stereo_c   },
+    { load_s16be_mono_c, load_s16be_stereo_c },
+    { load_s24le_mono_c, load_s24le_stereo_c },
+    { load_fltp_c,       load_fltp_c         },
+};
+
+/* the SIMD versions leave the 3 byte samples to C */
+#if HAVE_SSE2
+static av_always_inline __m128i reverse_epi16_sse2(__m128i v)
+{
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+static av_always_inline __m128i load_epi16_sse2(const uint8_t *src, int be)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)src);
+
+    if (be)
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    return v;
+}
+
+static av_always_inline void load_s16_tmpl_sse2(short *buf, const uint8_t *src, int ch,
+                                                int be, int nb_channels)
+{
+    __m128i a, b;
+    int i;
+
+    for(i=0;i<4;i++) {
+        a = load_epi16_sse2(src + 16 * nb_channels * i, be);
+        if (nb_channels == 2) {
+            /* the samples of ch from the pairs, sign extended */
+            b = load_epi16_sse2(src + 32 * i + 16, be);
+            if (!ch) {
+                a = _mm_slli_epi32(a, 16);
+                b = _mm_slli_epi32(b, 16);
+            }
+            a = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+        }
+        _mm_storeu_si128((__m128i *)(buf + 24 - 8 * i), reverse_epi16_sse2(a));
+    }
+}
+
+#define LOAD_S16_SSE2(name, be, nb_channels)                                  \
+static void load_ ## name ## _sse2(short *buf, const uint8_t *src, int ch)  \
+{                                                                            \
+    load_s16_tmpl_sse2(buf, src, ch, be, nb_channels);                       \
+}
+
+LOAD_S16_SSE2(s16_mono,     0, 1)
+LOAD_S16_SSE2(s16_stereo,   0, 2)
+LOAD_S16_SSE2(s16be_mono,   1, 1)
+LOAD_S16_SSE2(s16be_stereo, 1, 2)
+
+static void load_fltp_sse2(short *buf, const uint8_t *src, av_unused int ch)
+{
+    const float *f = (const float *)src;
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 hi = _mm_set1_ps(32767.0f), lo = _mm_set1_ps(-32768.0f);
+    __m128 a, b;
+    int i;
+
+    for(i=0;i<4;i++) {
+        a = _mm_mul_ps(_mm_loadu_ps(f + 8 * i), scale);
+        b = _mm_mul_ps(_mm_loadu_ps(f + 8 * i + 4), scale);
+        a = _mm_max_ps(lo, _mm_min_ps(hi, a));
+        b = _mm_max_ps(lo, _mm_min_ps(hi, b));
+        _mm_storeu_si128((__m128i *)(buf + 24 - 8 * i),
+                         reverse_epi16_sse2(_mm_packs_epi32(_mm_cvtps_epi32(a),
+                                                            _mm_cvtps_epi32(b))));
+    }
+}
+
+static const LoadSamplesFunc load_samples_sse2[MPA_SAMPLE_FMT_NB][MPA_MAX_CHANNELS] = {
+    { load_s16_mono_sse2,   load_s16_stereo_sse2   },
+    { load_s16be_mono_sse2, load_s16be_stereo_sse2 },
+    { load_s24le_mono_c,    load_s24le_stereo_c    },
+    { load_fltp_sse2,       load_fltp_sse2         },
+};
+#endif
+#if HAVE_NEON
+static av_always_inline int16x8_t reverse_s16_neon(int16x8_t v)
+{
+    v = vrev64q_s16(v);
+    return vcombine_s16(vget_high_s16(v), vget_low_s16(v));
+}
+
+static av_always_inline void load_s16_tmpl_neon(short *buf, const uint8_t *src, int ch,
+                                                int be, int nb_channels)
+{
+    const int16_t *p = (const int16_t *)src;
+    int16x8_t v;
+    int i;
+
+    for(i=0;i<4;i++) {
+        if (nb_channels == 2) {
+            int16x8x2_t pair = vld2q_s16(p + 16 * i);
+            v = ch ? pair.val[1] : pair.val[0];
+        } else {
+            v = vld1q_s16(p + 8 * i);
+        }
+        if (be)
+            v = vreinterpretq_s16_u8(vrev16q_u8(vreinterpretq_u8_s16(v)));
+        vst1q_s16(buf + 24 - 8 * i, reverse_s16_neon(v));
+    }
+}
+
+#define LOAD_S16_NEON(name, be, nb_channels)                                  \
+static void load_ ## name ## _neon(short *buf, const uint8_t *src, int ch)  \
+{                                                                            \
+    load_s16_tmpl_neon(buf, src, ch, be, nb_channels);                       \
+}
+
+LOAD_S16_NEON(s16_mono,     0, 1)
+LOAD_S16_NEON(s16_stereo,   0, 2)
+LOAD_S16_NEON(s16be_mono,   1, 1)
+LOAD_S16_NEON(s16be_stereo, 1, 2)
+
+#if defined(__aarch64__)
+static void load_fltp_neon(short *buf, const uint8_t *src, av_unused int ch)
+{
+    const float *f = (const float *)src;
+    const float32x4_t hi = vdupq_n_f32(32767.0f), lo = vdupq_n_f32(-32768.0f);
+    float32x4_t a, b;
+    int i;
+
+    for(i=0;i<4;i++) {
+        a = vmaxq_f32(vminq_f32(vmulq_n_f32(vld1q_f32(f + 8 * i), 32768.0f), hi), lo);
+        b = vmaxq_f32(vminq_f32(vmulq_n_f32(vld1q_f32(f + 8 * i + 4), 32768.0f), hi), lo);
+        vst1q_s16(buf + 24 - 8 * i,
+                  reverse_s16_neon(vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(a)),
+                                                vqmovn_s32(vcvtnq_s32_f32(b)))));
+    }
+}
+#else
+/* no rounding conversion before ARMv8 */
+#define load_fltp_neon load_fltp_c
+#endif
+
+static const LoadSamplesFunc load_samples_neon[MPA_SAMPLE_FMT_NB][MPA_MAX_CHANNELS] = {
+    { load_s16_mono_neon,   load_s16_stereo_neon   },
+    { load_s16be_mono_neon, load_s16be_stereo_neon },
+    { load_s24le_mono_c,    load_s24le_stereo_c    },
+    { load_fltp_neon,       load_fltp_neon         },
+};
+#endif
+
+static av_always_inline void convert_samples_tmpl(short *dst, const uint8_t *src, int ch, int n,
+                                                  int fmt, int nb_channels)
+{
+    int size = sample_fmt_bytes[fmt];
+    int i;
+
+    if (sample_fmt_planar[fmt])
+        nb_channels = 1;
+    else
+        src += ch * size;
+    for(i=0;i<n;i++)
+        dst[i] = load_sample(src + i * size * nb_channels, fmt);
+}
+
+#define CONVERT_SAMPLES_C(name, fmt, nb_channels)                                  \
+static void convert_ ## name ## _c(short *dst, const uint8_t *src, int ch, int n) \
+{                                                                                  \
+    convert_samples_tmpl(dst, src, ch, n, fmt, nb_channels);                      \
+}
+
+CONVERT_SAMPLES_C(s16_mono,     MPA_SAMPLE_FMT_S16,   1)
+CONVERT_SAMPLES_C(s16_stereo,   MPA_SAMPLE_FMT_S16,   2)
+CONVERT_SAMPLES_C(s16be_mono,   MPA_SAMPLE_FMT_S16BE, 1)
+CONVERT_SAMPLES_C(s16be_stereo, MPA_SAMPLE_FMT_S16BE, 2)
+CONVERT_SAMPLES_C(s24le_mono,   MPA_SAMPLE_FMT_S24LE, 1)
+CONVERT_SAMPLES_C(s24le_stereo, MPA_SAMPLE_FMT_S24LE, 2)
+CONVERT_SAMPLES_C(fltp,         MPA_SAMPLE_FMT_FLTP,  1)
+
+static const ConvertSamplesFunc convert_samples_c[MPA_SAMPLE_FMT_NB][MPA_MAX_CHANNELS] = {
+    { convert_s16_mono_c,   convert_s16_stereo_c   },
+    { convert_s16be_mono_c, convert_s16be_stereo_c },
+    { convert_s24le_mono_c, convert_s24le_stereo_c },
+    { convert_fltp_c,       convert_fltp_c         },
+};
+
+#define CONVERT_CHANNEL_C(name, fmt)                                                   \
+static void convert_channel_ ## name ## _c(short *dst, const uint8_t *src, int stride, int n) \
+{                                                                                      \
+    int i;                                                                             \
+                                                                                       \
+    for(i=0;i<n;i++)                                                                   \
+        dst[i] = load_sample(src + i * stride, fmt);                                   \
+}
+
+CONVERT_CHANNEL_C(s16,   MPA_SAMPLE_FMT_S16)
+CONVERT_CHANNEL_C(s16be, MPA_SAMPLE_FMT_S16BE)
+CONVERT_CHANNEL_C(s24le, MPA_SAMPLE_FMT_S24LE)
+CONVERT_CHANNEL_C(fltp,  MPA_SAMPLE_FMT_FLTP)
+
+static const ConvertChannelFunc convert_channel_c[MPA_SAMPLE_FMT_NB] = {
+    convert_channel_s16_c, convert_channel_s16be_c, convert_channel_s24le_c, convert_channel_fltp_c,
+};
+
+/* input of samples in format fmt, in the planes data[] or interleaved
+   in data[0] */
+static void input_init(MpegAudioContext *s, MPAInput *in, int fmt, const void * const *data)
+{
+    int i, planar = sample_fmt_planar[fmt];
+
+    in->load = s->dsp->load_samples[fmt][s->nb_channels - 1];
+    in->convert = convert_samples_c[fmt][s->nb_channels - 1];
+    in->convert_channel = convert_channel_c[fmt];
+    for(i=0;i<s->nb_in_channels;i++)
+        in->data[i] = data[planar ? i : 0];
+    for(i=0;i<MPA_MAX_CHANNELS;i++)
+        in->pos[i] = 0;
+    in->sample_size = sample_fmt_bytes[fmt] * (planar ? 1 : s->nb_in_channels);
+    in->channel_size = planar ? 0 : sample_fmt_bytes[fmt];
+}
+
+/*
+ * Downmix kernels. The gains of a channel add up to at most 2 in
+ * absolute value, so the sums fit in 32 bits; the result is rounded and
+ * saturated in the same way in every version.
+ */
+static void downmix_c(short *dst, const short (*x)[32], const short *coefs, int nb)
+{
+    int j, k, sum;
+
+    for(j=0;j<32;j++) {
+        sum = 1 << 13;
+        for(k=0;k<nb;k++)
+            sum += x[k][j] * coefs[k];
+        dst[j] = av_clip_int16(sum >> 14);
+    }
+}
+
+#if HAVE_AVX2
+static av_target_avx2 void downmix_avx2(short *dst, const short (*x)[32], const short *coefs, int nb)
+{
+    const __m256i round = _mm256_set1_epi32(1 << 13);
+    int j, k;
+
+    for(j=0;j<32;j+=16) {
+        __m256i lo = round, hi = round;
+        /* two input channels per multiply-add */
+        for(k=0;k<nb;k+=2) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(x[k] + j));
+            __m256i b = k + 1 < nb ? _mm256_loadu_si256((const __m256i *)(x[k + 1] + j)) :
+                                     _mm256_setzero_si256();
+            __m256i c = _mm256_set1_epi32((uint16_t)coefs[k] |
+                                          (k + 1 < nb ? coefs[k + 1] : 0) * 65536);
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), c));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), c));
+        }
+        /* unpack and pack both work on 128 bit lanes, so the order is kept */
+        _mm256_storeu_si256((__m256i *)(dst + j),
+                            _mm256_packs_epi32(_mm256_srai_epi32(lo, 14), _mm256_srai_epi32(hi, 14)));
+    }
+}
+#endif
+#if HAVE_SSE2
+static void downmix_sse2(short *dst, const short (*x)[32], const short *coefs, int nb)
+{
+    const __m128i round = _mm_set1_epi32(1 << 13);
+    int j, k;
+
+    for(j=0;j<32;j+=8) {
+        __m128i lo = round, hi = round;
+        /* two input channels per multiply-add */
+        for(k=0;k<nb;k+=2) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(x[k] + j));
+            __m128i b = k + 1 < nb ? _mm_loadu_si128((const __m128i *)(x[k + 1] + j)) :
+                                     _mm_setzero_si128();
+            __m128i c = _mm_set1_epi32((uint16_t)coefs[k] |
+                                       (k + 1 < nb ? coefs[k + 1] : 0) * 65536);
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), c));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), c));
+        }
+        _mm_storeu_si128((__m128i *)(dst + j),
+                         _mm_packs_epi32(_mm_srai_epi32(lo, 14), _mm_srai_epi32(hi, 14)));
+    }
+}
+#endif
+#if HAVE_NEON
+static void downmix_neon(short *dst, const short (*x)[32], const short *coefs, int nb)
+{
+    int j, k;
+
+    for(j=0;j<32;j+=8) {
+        int32x4_t lo = vdupq_n_s32(0), hi = vdupq_n_s32(0);
+        for(k=0;k<nb;k++) {
+            int16x8_t a = vld1q_s16(x[k] + j);
+            lo = vmlal_n_s16(lo, vget_low_s16(a),  coefs[k]);
+            hi = vmlal_n_s16(hi, vget_high_s16(a), coefs[k]);
+        }
+        vst1q_s16(dst + j, vcombine_s16(vqrshrn_n_s32(lo, 14), vqrshrn_n_s32(hi, 14)));
+    }
+}
+#endif
+
+/* n samples of channel ch mixed down from the input channels, in order */
+static void downmix_read(MpegAudioContext *s, MPAInput *in, short *dst, int ch, int n)
+{
+    const MPADownmix *d = &s->downmix[ch];
+    short x[MPA_MAX_INPUT_CHANNELS][32];
+    short tmp[32];
+    size_t pos = in->pos[ch];
+    int k, m;
+
+    for(;n>0;n-=m,dst+=m,pos+=m) {
+        m = FFMIN(n, 32);
+        for(k=0;k<d->nb;k++) {
+            int i = d->in[k];
+            in->convert_channel(x[k], in->data[i] + i * in->channel_size + pos * in->sample_size,
+                                in->sample_size, m);
+            if (m < 32)
+                memset(x[k] + m, 0, (32 - m) * sizeof(x[k][0]));
+        }
+        if (m < 32) {
+            s->dsp->downmix(tmp, (const short (*)[32])x, d->coefs, d->nb);
+            memcpy(dst, tmp, m * sizeof(*dst));
+        } else {
+            s->dsp->downmix(dst, (const short (*)[32])x, d->coefs, d->nb);
+        }
+    }
+}
+
+/* the next n samples of channel ch, in order */
+static void input_read(MpegAudioContext *s, MPAInput *in, short *dst, int ch, int n)
+{
+    if (s->do_downmix)
+        downmix_read(s, in, dst, ch, n);
+    else
+        in->convert(dst, in->data[ch] + in->pos[ch] * in->sample_size, ch, n);
+    in->pos[ch] += n;
+}
+
+/* input samples read once the output samples before k are computed:
+   up to the last tap of output k - 1 */
+static int64_t resample_input_pos(const ResampleTables *rs, int64_t k)
+{
+    if (!k)
+        return 0;
+    return (k - 1) * rs->step / rs->phases + rs->taps / 2 + 1;
+}
+
+static void resample_c(short *buf, const short *x, const int16_t * const coefs[32],
+                       const int offsets[32], int taps)
+{
+    int i, j, sum;
+
+    for(j=0;j<32;j++) {
+        const short *p = x + offsets[j];
+        sum = 1 << 14;
+        for(i=0;i<taps;i++)
+            sum += p[i] * coefs[j][i];
+        buf[31 - j] = av_clip_int16(sum >> 15);
+    }
+}
+
+/* the sums fit in 32 bits: the coefficients add up to less than 2 in
+   absolute value */
+#if HAVE_AVX2
+static av_target_avx2 void resample_avx2(short *buf, const short *x,
+                                         const int16_t * const coefs[32],
+                                         const int offsets[32], int taps)
+{
+    int i, j;
+
+    for(j=0;j<32;j++) {
+        const short *p = x + offsets[j];
+        __m256i sum = _mm256_setzero_si256();
+        __m128i s;
+        for(i=0;i<taps;i+=16)
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)(p + i)),
+                                                          _mm256_loadu_si256((const __m256i *)(coefs[j] + i))));
+        s = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+        s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+        s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+        buf[31 - j] = av_clip_int16((_mm_cvtsi128_si32(s) + (1 << 14)) >> 15);
+    }
+}
+#endif
+#if HAVE_SSE2
+static void resample_sse2(short *buf, const short *x, const int16_t * const coefs[32],
+                          const int offsets[32], int taps)
+{
+    int i, j;
+
+    for(j=0;j<32;j++) {
+        const short *p = x + offsets[j];
+        __m128i sum = _mm_setzero_si128();
+        for(i=0;i<taps;i+=8)
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(p + i)),
+                                                    _mm_loadu_si128((const __m128i *)(coefs[j] + i))));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+        buf[31 - j] = av_clip_int16((_mm_cvtsi128_si32(sum) + (1 << 14)) >> 15);
+    }
+}
+#endif
+#if HAVE_NEON
+static void resample_neon(short *buf, const short *x, const int16_t * const coefs[32],
+                          const int offsets[32], int taps)
+{
+    int i, j;
+
+    for(j=0;j<32;j++) {
+        const short *p = x + offsets[j];
+        int32x4_t sum = vdupq_n_s32(0);
+        int32x2_t s;
+        for(i=0;i<taps;i+=8) {
+            int16x8_t a = vld1q_s16(p + i);
+            int16x8_t b = vld1q_s16(coefs[j] + i);
+            sum = vmlal_s16(sum, vget_low_s16(a),  vget_low_s16(b));
+            sum = vmlal_s16(sum, vget_high_s16(a), vget_high_s16(b));
+        }
+        s = vadd_s32(vget_low_s32(sum), vget_high_s32(sum));
+        s = vpadd_s32(s, s);
+        buf[31 - j] = av_clip_int16((vget_lane_s32(s, 0) + (1 << 14)) >> 15);
+    }
+}
+#endif
+
+/* block of 32 output samples of channel ch, from frame sample 32 * block */
+static void resample_block(MpegAudioContext *s, MPAInput *in, short *buf, int ch, int block)
+{
+    const ResampleTables *rs = s->rs;
+    short x[RS_MAX_TAPS + 32 * RS_MAX_RATIO + RS_MAX_TAPS / 2 + 1];
+    const int16_t *coefs[32];
+    int offsets[32];
+    short *hist = s->chan[ch].rs_hist;
+    int64_t k = s->rs_out + 32 * block, pos, start;
+    int taps = rs->taps, n, p, j, nb_in;
+
+    /* x: the last taps input samples, then the new ones of the block */
+    start = resample_input_pos(rs, k);
+    nb_in = (int)(resample_input_pos(rs, k + 32) - start);
+    memcpy(x, hist, taps * sizeof(*x));
+    input_read(s, in, x + taps, ch, nb_in);
+
+    pos = k * rs->step;
+    n = (int)(pos / rs->phases - start) + taps / 2 + 1;
+    p = (int)(pos % rs->phases);
+    for(j=0;j<32;j++) {
+        offsets[j] = n;
+        coefs[j] = rs->coefs + p * taps;
+        n += rs->step / rs->phases;
+        p += rs->step % rs->phases;
+        if (p >= rs->phases) {
+            p -= rs->phases;
+            n++;
+        }
+    }
+    s->dsp->resample(buf, x, coefs, offsets, taps);
+    memcpy(hist, x + nb_in, taps * sizeof(*x));
+}
+
+/* the next 32 samples of channel ch for the filter bank, block of the
+   frame, most recent first */
+static av_always_inline void input_block(MpegAudioContext *s, MPAInput *in, short *buf,
+                                         int ch, int block)
+{
+    short tmp[32];
+    int i;
+
+    if (s->rs) {
+        resample_block(s, in, buf, ch, block);
+    } else if (s->do_downmix) {
+        downmix_read(s, in, tmp, ch, 32);
+        for(i=0;i<32;i++)
+            buf[31 - i] = tmp[i];
+        in->pos[ch] += 32;
+    } else {
+        in->load(buf, in->data[ch] + in->pos[ch] * in->sample_size, ch);
+        in->pos[ch] += 32;
+    }
+}
+
+#define WSHIFT (WFRAC_BITS + 15 - FRAC_BITS)
+
+/*
+ * Window the 512 history samples: tmp[i] = sum(p[i + 64*k] * q[i + 64*k])
+ * for k = 0..7. The SIMD versions pair rows k and k+1 so that each 16 bit
+ * multiply-add instruction produces two terms of the sum; 32 bit wrap
+ * around is the same as in the C version, so the results are identical.
+ */
+#if HAVE_AVX2
+static av_target_avx2 void window_filter_avx2(int tmp[64], const short *p)
+{
+    const short *q = s_filter_bank;
+    int i, k;
+
+    for(i=0;i<64;i+=16) {
+        __m256i lo = _mm256_setzero_si256();
+        __m256i hi = _mm256_setzero_si256();
+        for(k=0;k<8;k+=2) {
+            __m256i p0 = _mm256_loadu_si256((const __m256i *)(p + i + k * 64));
+            __m256i p1 = _mm256_loadu_si256((const __m256i *)(p + i + k * 64 + 64));
+            __m256i q0 = _mm256_loadu_si256((const __m256i *)(q + i + k * 64));
+            __m256i q1 = _mm256_loadu_si256((const __m256i *)(q + i + k * 64 + 64));
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(p0, p1),
+                                                        _mm256_unpacklo_epi16(q0, q1)));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(p0, p1),
+                                                        _mm256_unpackhi_epi16(q0, q1)));
+        }
+        /* unpack works on 128 bit lanes: lo = 0..3,8..11 and hi = 4..7,12..15 */
+        _mm256_storeu_si256((__m256i *)(tmp + i),     _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(tmp + i + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+}
+#endif
+#if HAVE_SSE2
+static void window_filter_sse2(int tmp[64], const short *p)
+{
+    const short *q = s_filter_bank;
+    int i, k;
+
+    for(i=0;i<64;i+=8) {
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+        for(k=0;k<8;k+=2) {
+            __m128i p0 = _mm_loadu_si128((const __m128i *)(p + i + k * 64));
+            __m128i p1 = _mm_loadu_si128((const __m128i *)(p + i + k * 64 + 64));
+            __m128i q0 = _mm_loadu_si128((const __m128i *)(q + i + k * 64));
+            __m128i q1 = _mm_loadu_si128((const __m128i *)(q + i + k * 64 + 64));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(p0, p1),
+                                                  _mm_unpacklo_epi16(q0, q1)));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(p0, p1),
+                                                  _mm_unpackhi_epi16(q0, q1)));
+        }
+        _mm_storeu_si128((__m128i *)(tmp + i),     lo);
+        _mm_storeu_si128((__m128i *)(tmp + i + 4), hi);
+    }
+}
+#endif
+#if HAVE_NEON
+static void window_filter_neon(int tmp[64], const short *p)
+{
+    const short *q = s_filter_bank;
+    int i, k;
+
+    for(i=0;i<64;i+=8) {
+        int32x4_t lo = vdupq_n_s32(0);
+        int32x4_t hi = vdupq_n_s32(0);
+        for(k=0;k<8;k++) {
+            int16x8_t p0 = vld1q_s16(p + i + k * 64);
+            int16x8_t q0 = vld1q_s16(q + i + k * 64);
+            lo = vmlal_s16(lo, vget_low_s16(p0),  vget_low_s16(q0));
+            hi = vmlal_s16(hi, vget_high_s16(p0), vget_high_s16(q0));
+        }
+        vst1q_s32(tmp + i,     lo);
+        vst1q_s32(tmp + i + 4, hi);
+    }
+}
+#endif
+static void window_filter_c(int tmp[64], const short *p)
+{
+    const short *q = s_filter_bank;
+    int sum, i;
+
+    /* maxsum = 23169 */
+    for(i=0;i<64;i++) {
+        sum = p[0*64] * q[0*64];
+        sum += p[1*64] * q[1*64];
+        sum += p[2*64] * q[2*64];
+        sum += p[3*64] * q[3*64];
+        sum += p[4*64] * q[4*64];
+        sum += p[5*64] * q[5*64];
+        sum += p[6*64] * q[6*64];
+        sum += p[7*64] * q[7*64];
+        tmp[i] = sum;
+        p++;
+        q++;
+    }
+}
+
+static void filter_c(MpegAudioContext *s, int ch, MPAInput *in)
+{
+    int offset, i, j;
+    int tmp[64];
+    int tmp1[32];
+    int *out;
+    short *buf;
+
+    offset = s->frame->samples_offset[ch];
+    out = &s->frame->sb_samples[ch][0][0][0];
+    for(j=0;j<36;j++) {
+        /* 32 samples at once */
+        buf = s->frame->samples_buf[ch] + offset;
+        input_block(s, in, buf, ch, j);
+        if (offset < 512 - 32)
+            memcpy(buf + SAMPLES_RING_SIZE, buf, 32 * sizeof(*buf));
+
+        /* filter */
+        window_filter_c(tmp, buf);
+        tmp1[0] = tmp[16] >> WSHIFT;
+        for( i=1; i<=16; i++ ) tmp1[i] = (tmp[i+16]+tmp[16-i]) >> WSHIFT;
+        for( i=17; i<=31; i++ ) tmp1[i] = (tmp[i+16]-tmp[80-i]) >> WSHIFT;
+
+        idct32(out, tmp1);
+        out += 32;
+
+        /* advance of 32 samples */
+        offset -= 32;
+        /* handle the wrap around */
+        if (offset < 0)
+            offset += SAMPLES_RING_SIZE;
+    }
+    s->frame->samples_offset[ch] = offset;
+}
+
+/* idct32() with the interface of idct32_lanes(), for one lane: with a
+   single lane the nb_blocks blocks of in follow each other */
+static void idct32_blocks_c(int *out, const int *in, int nb_blocks)
+{
+    int tab[32];
+    int b;
+
+    for(b=0;b<nb_blocks;b++) {
+        memcpy(tab, in + 32 * b, sizeof(tab));
+        idct32(out + 32 * b, tab);
+    }
+}
+
+/* the filter bank of each instruction set */
+#if HAVE_AVX2
+#define RENAME(name) name ## _avx2
+#define FUNC_ATTR    av_target_avx2
+#define IDCT_LANES   8
+#define idct_vec     __m256i
+#define VLOAD(p)     _mm256_loadu_si256((const __m256i *)(p))
+#define VSTORE(p, a) _mm256_storeu_si256((__m256i *)(p), a)
+#define VADD(a, b)   _mm256_add_epi32(a, b)
+#define VSUB(a, b)   _mm256_sub_epi32(a, b)
+#define VNEG(a)      _mm256_sub_epi32(_mm256_setzero_si256(), a)
+#define VMUL(a, b)   vmul_avx2(a, b)
+#include "mp2en_template.c"
+#endif
+#if HAVE_SSE2
+#define RENAME(name) name ## _sse2
+#define FUNC_ATTR
+#define IDCT_LANES   4
+#define idct_vec     __m128i
+#define VLOAD(p)     _mm_loadu_si128((const __m128i *)(p))
+#define VSTORE(p, a) _mm_storeu_si128((__m128i *)(p), a)
+#define VADD(a, b)   _mm_add_epi32(a, b)
+#define VSUB(a, b)   _mm_sub_epi32(a, b)
+#define VNEG(a)      _mm_sub_epi32(_mm_setzero_si128(), a)
+#define VMUL(a, b)   vmul_sse2(a, b)
+#include "mp2en_template.c"
+#endif
+#if HAVE_NEON
+#define RENAME(name) name ## _neon
+#define FUNC_ATTR
+#define IDCT_LANES   4
+#define idct_vec     int32x4_t
+#define VLOAD(p)     vld1q_s32(p)
+#define VSTORE(p, a) vst1q_s32(p, a)
+#define VADD(a, b)   vaddq_s32(a, b)
+#define VSUB(a, b)   vsubq_s32(a, b)
+#define VNEG(a)      vnegq_s32(a)
+#define VMUL(a, b)   vmul_neon(a, b)
+#include "mp2en_template.c"
+#endif
+
+/* max absolute value of the 12 samples of each part of each subband;
+   the samples of a given time are contiguous across the subbands */
+#if HAVE_AVX2
+static av_target_avx2 void compute_max_abs_avx2(int vmax[3][SBLIMIT], int sb_samples[3][12][SBLIMIT])
+{
+    int i, j, k;
+
+    for(i=0;i<3;i++) {
+        for(j=0;j<SBLIMIT;j+=8) {
+            __m256i m = _mm256_abs_epi32(_mm256_loadu_si256((const __m256i *)&sb_samples[i][0][j]));
+            for(k=1;k<12;k++)
+                m = _mm256_max_epi32(m, _mm256_abs_epi32(_mm256_loadu_si256((const __m256i *)&sb_samples[i][k][j])));
+            _mm256_storeu_si256((__m256i *)&vmax[i][j], m);
+        }
+    }
+}
+#endif
+#if HAVE_SSE2
+static av_always_inline __m128i abs_sse2(__m128i a)
+{
+    __m128i sign = _mm_srai_epi32(a, 31);
+    return _mm_sub_epi32(_mm_xor_si128(a, sign), sign);
+}
+
+static void compute_max_abs_sse2(int vmax[3][SBLIMIT], int sb_samples[3][12][SBLIMIT])
+{
+    int i, j, k;
+
+    for(i=0;i<3;i++) {
+        for(j=0;j<SBLIMIT;j+=4) {
+            __m128i m = abs_sse2(_mm_loadu_si128((const __m128i *)&sb_samples[i][0][j]));
+            for(k=1;k<12;k++) {
+                __m128i v = abs_sse2(_mm_loadu_si128((const __m128i *)&sb_samples[i][k][j]));
+                __m128i gt = _mm_cmpgt_epi32(v, m);
+                m = _mm_or_si128(_mm_and_si128(gt, v), _mm_andnot_si128(gt, m));
+            }
+            _mm_storeu_si128((__m128i *)&vmax[i][j], m);
+        }
+    }
+}
+#endif
+#if HAVE_NEON
+static void compute_max_abs_neon(int vmax[3][SBLIMIT], int sb_samples[3][12][SBLIMIT])
+{
+    int i, j, k;
+
+    for(i=0;i<3;i++) {
+        for(j=0;j<SBLIMIT;j+=4) {
+            int32x4_t m = vabsq_s32(vld1q_s32(&sb_samples[i][0][j]));
+            for(k=1;k<12;k++)
+                m = vmaxq_s32(m, vabsq_s32(vld1q_s32(&sb_samples[i][k][j])));
+            vst1q_s32(&vmax[i][j], m);
+        }
+    }
+}
+#endif
+static void compute_max_abs_c(int vmax[3][SBLIMIT], int sb_samples[3][12][SBLIMIT])
+{
+    int i, j, k, v;
+
+    for(i=0;i<3;i++) {
+        for(j=0;j<SBLIMIT;j++)
+            vmax[i][j] = abs(sb_samples[i][0][j]);
+        for(k=1;k<12;k++) {
+            for(j=0;j<SBLIMIT;j++) {
+                v = abs(sb_samples[i][k][j]);
+                if (v > vmax[i][j])
+                    vmax[i][j] = v;
+            }
+        }
+    }
+}
+
+/* transmission patterns of the scale factors, indexed by d1 * 5 + d2:
+   scale code, then the source of each of the 3 scale factors among
+   { sf[0], sf[1], sf[2], min(sf[0], sf[2]) } */
+static const unsigned char scale_patterns[25][4] = {
+    { 0, 0, 1, 2 }, { 3, 0, 1, 1 }, { 3, 0, 1, 1 }, { 3, 0, 2, 2 }, { 0, 0, 1, 2 },
+    { 1, 0, 0, 2 }, { 2, 0, 0, 0 }, { 2, 0, 0, 0 }, { 2, 3, 3, 3 }, { 1, 0, 0, 2 },
+    { 2, 0, 0, 0 }, { 2, 0, 0, 0 }, { 2, 0, 0, 0 }, { 2, 2, 2, 2 }, { 1, 0, 0, 2 },
+    { 2, 1, 1, 1 }, { 2, 1, 1, 1 }, { 2, 1, 1, 1 }, { 2, 2, 2, 2 }, { 0, 0, 1, 2 },
+    { 0, 0, 1, 2 }, { 3, 0, 1, 1 }, { 3, 0, 1, 1 }, { 3, 0, 2, 2 }, { 0, 0, 1, 2 },
+};
+
+static void compute_scale_factors(MpegAudioContext *s,
+                                  unsigned char scale_code[SBLIMIT],
                                   unsigned char scale_factors[SBLIMIT][3],
                                   int sb_samples[3][12][SBLIMIT],
                                   int sblimit)
 {
-    int *p, vmax, v, n, i, j, k, code;
-    int index, d1, d2;
+    int vmax[3][SBLIMIT];
+    int v, n, i, j, index, d1, d2;
     unsigned char *sf = &scale_factors[0][0];
+    unsigned char sfv[4];
+    const unsigned char *pattern;
+
+    s->dsp->compute_max_abs(vmax, sb_samples);
 
     for(j=0;j<sblimit;j++) {
         for(i=0;i<3;i++) {
-            /* find the max absolute value */
-            p = &sb_samples[i][0][j];
-            vmax = abs(*p);
-            for(k=1;k<12;k++) {
-                p += SBLIMIT;
-                v = abs(*p);
-                if (v > vmax)
-                    vmax = v;
-            }
-            /* compute the scale factor index using log 2 computations */
-            if (vmax > 1) {
-                n = av_log2(vmax);
-                /* n is the position of the MSB of vmax. now
-                   use at most 2 compares to find the index */
-                index = (21 - n) * 3 - 3;
-                if (index >= 0) {
-                    while (vmax <= s_scale_factor_table[index+1])
-                        index++;
-                } else {
-                    index = 0; /* very unlikely case of overflow */
-                }
-            } else {
-                index = 62; /* value 63 is not allowed */
-            }
+            v = vmax[i][j];
+            /* n is the position of the MSB of v: the index is at most 3
+               steps after the first one of the 2^n range. Values >= 2^22
+               overflow to index 0 and values <= 1 give index 62 (value 63
+               is not allowed). */
+            n = ff_log2(v | 1);
+            index = FFMAX((21 - n) * 3 - 3, 0);
+            index += (v <= s_scale_factor_table[index + 1]) +
+                     (v <= s_scale_factor_table[index + 2]) +
+                     (v <= s_scale_factor_table[index + 3]);
+            index = FFMIN(index, 62);
 
             ff_dlog(NULL, "%2d:%d in=%x %x %d\n",
-                    j, i, vmax, s_scale_factor_table[index], index);
+                    j, i, v, s_scale_factor_table[index], index);
             /* store the scale factor */
             av_assert2(index >=0 && index <= 63);
             sf[i] = index;
@@ -1025,364 +2507,1833 @@ static void compute_scale_factors(MpegAudioContext *s,
         d2 = s_scale_diff_table[sf[1] - sf[2] + 64];
 
         /* handle the 25 cases */
-        switch(d1 * 5 + d2) {
-        case 0*5+0:
-        case 0*5+4:
-        case 3*5+4:
-        case 4*5+0:
-        case 4*5+4:
-            code = 0;
-            break;
-        case 0*5+1:
-        case 0*5+2:
-        case 4*5+1:
-        case 4*5+2:
-            code = 3;
-            sf[2] = sf[1];
-            break;
-        case 0*5+3:
-        case 4*5+3:
-            code = 3;
-            sf[1] = sf[2];
-            break;
-        case 1*5+0:
-        case 1*5+4:
-        case 2*5+4:
-            code = 1;
-            sf[1] = sf[0];
-            break;
-        case 1*5+1:
-        case 1*5+2:
-        case 2*5+0:
-        case 2*5+1:
-        case 2*5+2:
-            code = 2;
-            sf[1] = sf[2] = sf[0];
-            break;
-        case 2*5+3:
-        case 3*5+3:
-            code = 2;
-            sf[0] = sf[1] = sf[2];
-            break;
-        case 3*5+0:
-        case 3*5+1:
-        case 3*5+2:
-            code = 2;
-            sf[0] = sf[2] = sf[1];
-            break;
-        case 1*5+3:
-            code = 2;
-            if (sf[0] > sf[2])
-              sf[0] = sf[2];
-            sf[1] = sf[2] = sf[0];
-            break;
-        default:
-            av_assert2(0); //cannot happen
-            code = 0;           /* kill warning */
-        }
+        pattern = scale_patterns[d1 * 5 + d2];
+        sfv[0] = sf[0];
+        sfv[1] = sf[1];
+        sfv[2] = sf[2];
+        sfv[3] = FFMIN(sf[0], sf[2]);
+        sf[0] = sfv[pattern[1]];
+        sf[1] = sfv[pattern[2]];
+        sf[2] = sfv[pattern[3]];
 
         ff_dlog(NULL, "%d: %2d %2d %2d %d %d -> %d\n", j,
-                sf[0], sf[1], sf[2], d1, d2, code);
-        scale_code[j] = code;
+                sf[0], sf[1], sf[2], d1, d2, pattern[0]);
+        scale_code[j] = pattern[0];
         sf += 3;
     }
 }
 
-/* The most important function : psycho acoustic module. In this
-   encoder there is basically none, so this is the worst you can do,
-   but also this is the simpler. */
-static void psycho_acoustic_model(MpegAudioContext *s, short smr[SBLIMIT])
+/* The psycho acoustic model follows model 1 of ISO 11172-3: tonal and
+   noise maskers are found in a 1024 point power spectrum, each is spread
+   over the Bark scale and the masking threshold of a subband is the
+   lowest sum of them and of the threshold in quiet. To bound the cost
+   only the PSY_MAX_MASKERS strongest maskers are kept and the threshold
+   is computed on a grid of PSY_GRID_STEPS points per Bark instead of
+   the tables of the standard. */
+#define PSY_MAX_MASKERS 32
+#define PSY_SMR_MAX     2000    /* 200 dB */
+/* -17 dB per Bark of the spreading function, per grid step */
+#define PSY_SLOPE_17    0.375837404f
+
+typedef struct PsyMasker {
+    float power;
+    int grid;
+    int tonal;
+} PsyMasker;
+
+/* butterflies of a group of a FFT stage: c = a + b, d = (a - b) * w */
+static av_always_inline void psy_butterflies_c(float *cr, float *ci, float *dr, float *di,
+                                               const float *ar, const float *ai,
+                                               const float *br, const float *bi,
+                                               float wr, float wi, int n)
+{
+    int q;
+
+    for(q=0;q<n;q++) {
+        float ur = ar[q] - br[q], ui = ai[q] - bi[q];
+        cr[q] = ar[q] + br[q];
+        ci[q] = ai[q] + bi[q];
+        dr[q] = ur * wr - ui * wi;
+        di[q] = ur * wi + ui * wr;
+    }
+}
+
+/* same on multiples of 4, with the same operations as the C version */
+#if HAVE_SSE2
+#define PSY_SIMD 1
+static av_always_inline void psy_butterflies_simd(float *cr, float *ci, float *dr, float *di,
+                                                  const float *ar, const float *ai,
+                                                  const float *br, const float *bi,
+                                                  float wr, float wi, int n)
+{
+    __m128 vwr = _mm_set1_ps(wr), vwi = _mm_set1_ps(wi);
+    int q;
+
+    for(q=0;q<n;q+=4) {
+        __m128 a_r = _mm_loadu_ps(ar + q), a_i = _mm_loadu_ps(ai + q);
+        __m128 b_r = _mm_loadu_ps(br + q), b_i = _mm_loadu_ps(bi + q);
+        __m128 ur = _mm_sub_ps(a_r, b_r), ui = _mm_sub_ps(a_i, b_i);
+        _mm_storeu_ps(cr + q, _mm_add_ps(a_r, b_r));
+        _mm_storeu_ps(ci + q, _mm_add_ps(a_i, b_i));
+        _mm_storeu_ps(dr + q, _mm_sub_ps(_mm_mul_ps(ur, vwr), _mm_mul_ps(ui, vwi)));
+        _mm_storeu_ps(di + q, _mm_add_ps(_mm_mul_ps(ur, vwi), _mm_mul_ps(ui, vwr)));
+    }
+}
+#elif HAVE_NEON
+#define PSY_SIMD 1
+static av_always_inline void psy_butterflies_simd(float *cr, float *ci, float *dr, float *di,
+                                                  const float *ar, const float *ai,
+                                                  const float *br, const float *bi,
+                                                  float wr, float wi, int n)
+{
+    int q;
+
+    for(q=0;q<n;q+=4) {
+        float32x4_t a_r = vld1q_f32(ar + q), a_i = vld1q_f32(ai + q);
+        float32x4_t b_r = vld1q_f32(br + q), b_i = vld1q_f32(bi + q);
+        float32x4_t ur = vsubq_f32(a_r, b_r), ui = vsubq_f32(a_i, b_i);
+        vst1q_f32(cr + q, vaddq_f32(a_r, b_r));
+        vst1q_f32(ci + q, vaddq_f32(a_i, b_i));
+        vst1q_f32(dr + q, vsubq_f32(vmulq_n_f32(ur, wr), vmulq_n_f32(ui, wi)));
+        vst1q_f32(di + q, vaddq_f32(vmulq_n_f32(ur, wi), vmulq_n_f32(ui, wr)));
+    }
+}
+#else
+#define PSY_SIMD 0
+#define psy_butterflies_simd psy_butterflies_c
+#endif
+
+/* Real FFT of PSY_FFT_SIZE points done as a complex FFT of half the
+   size, returning the power of the first half of the spectrum. The
+   radix-2 stages work on separate real and imaginary arrays without
+   bit reversal, so that all but the first two are contiguous runs of
+   4 or more butterflies with the same twiddle. */
+static void psy_power_spectrum(float power[PSY_FFT_SIZE / 2], const float *x)
+{
+    enum { M = PSY_FFT_SIZE / 2 };
+    float buf[4][M];
+    float *xr = buf[0], *xi = buf[1], *yr = buf[2], *yi = buf[3], *t;
+    int n, st, m, p, k;
+
+    for(k=0;k<M;k++) {
+        xr[k] = x[2 * k];
+        xi[k] = x[2 * k + 1];
+    }
+    /* Stockham autosort: stage of length n and stride st */
+    for(n=M,st=1;n>1;n>>=1,st<<=1) {
+        m = n >> 1;
+        for(p=0;p<m;p++) {
+            float wr = psy_cos[2 * p * st], wi = -psy_sin[2 * p * st];
+            float *cr = yr + st * 2 * p, *ci = yi + st * 2 * p;
+
+            if (PSY_SIMD && st >= 4)
+                psy_butterflies_simd(cr, ci, cr + st, ci + st,
+                                     xr + st * p, xi + st * p,
+                                     xr + st * (p + m), xi + st * (p + m), wr, wi, st);
+            else
+                psy_butterflies_c(cr, ci, cr + st, ci + st,
+                                  xr + st * p, xi + st * p,
+                                  xr + st * (p + m), xi + st * (p + m), wr, wi, st);
+        }
+        t = xr; xr = yr; yr = t;
+        t = xi; xi = yi; yi = t;
+    }
+    /* split the spectra of the even and odd samples */
+    for(k=0;k<M;k++) {
+        int j = (M - k) & (M - 1);
+        float er = 0.5f * (xr[k] + xr[j]), ei = 0.5f * (xi[k] - xi[j]);
+        float odr = 0.5f * (xi[k] + xi[j]), odi = 0.5f * (xr[j] - xr[k]);
+        float wr = psy_cos[k], wi = -psy_sin[k];
+        float re = er + odr * wr - odi * wi;
+        float im = ei + odr * wi + odi * wr;
+        power[k] = re * re + im * im;
+    }
+}
+
+/* add the masking threshold of a masker to mask */
+static void psy_spread(float *mask, int nb_grid, const PsyMasker *m)
+{
+    float x = 10 * log10f(m->power) + 96; /* level in dB */
+    float z = (float)m->grid / PSY_GRID_STEPS;
+    float v0, v, r;
+    int g, g0 = m->grid;
+
+    /* masking index */
+    if (m->tonal)
+        v0 = m->power * powf(10, (-6.025f - 0.275f * z) * 0.1f);
+    else
+        v0 = m->power * powf(10, (-2.025f - 0.175f * z) * 0.1f);
+    mask[g0] += v0;
+
+    /* the spreading function is linear in dB on each side, with a slope
+       depending on the level within 1 Bark under and beyond 1 Bark over
+       the masker, up to -3 and +8 Bark */
+    v = v0;
+    r = powf(10, -(0.4f * x + 6) * (0.1f / PSY_GRID_STEPS));
+    for(g=g0-1;g>=FFMAX(g0-PSY_GRID_STEPS,0);g--) {
+        v *= r;
+        mask[g] += v;
+    }
+    for(;g>=FFMAX(g0-3*PSY_GRID_STEPS,0);g--) {
+        v *= PSY_SLOPE_17;
+        mask[g] += v;
+    }
+    v = v0;
+    for(g=g0+1;g<=FFMIN(g0+PSY_GRID_STEPS,nb_grid-1);g++) {
+        v *= PSY_SLOPE_17;
+        mask[g] += v;
+    }
+    r = powf(10, -(17 - 0.15f * x) * (0.1f / PSY_GRID_STEPS));
+    for(;g<FFMIN(g0+8*PSY_GRID_STEPS,nb_grid);g++) {
+        v *= r;
+        mask[g] += v;
+    }
+}
+
+/* masking threshold of the maskers on the grid, and its minimum in
+   each subband */
+static void psy_mask_subbands(MpegAudioContext *s, int ch, PsyMasker *maskers, int nb)
+{
+    float mask[PSY_GRID_SIZE];
+    int i, j, g;
+
+    /* keep the strongest ones */
+    if (nb > PSY_MAX_MASKERS) {
+        for(i=0;i<PSY_MAX_MASKERS;i++) {
+            PsyMasker t;
+            int best = i;
+            for(j=i+1;j<nb;j++) {
+                if (maskers[j].power > maskers[best].power)
+                    best = j;
+            }
+            t = maskers[i];
+            maskers[i] = maskers[best];
+            maskers[best] = t;
+        }
+        nb = PSY_MAX_MASKERS;
+    }
+
+    memcpy(mask, s->psy->ath, s->psy->nb_grid * sizeof(*mask));
+    for(i=0;i<nb;i++)
+        psy_spread(mask, s->psy->nb_grid, &maskers[i]);
+
+    for(i=0;i<s->max_sblimit;i++) {
+        float v = mask[s->psy->sb_grid[i][0]];
+        for(g=s->psy->sb_grid[i][0]+1;g<=s->psy->sb_grid[i][1];g++)
+            v = FFMIN(v, mask[g]);
+        s->frame->psy_mask[ch][i] = v;
+    }
+}
+
+static void psy_add_masker(MpegAudioContext *s, PsyMasker *maskers, int *nb,
+                           float power, int grid, int tonal)
+{
+    PsyMasker *last;
+
+    /* inaudible */
+    if (power < s->psy->ath[grid])
+        return;
+    /* of two tonal maskers closer than 0.5 Bark only the strongest counts */
+    last = &maskers[FFMAX(*nb - 1, 0)];
+    if (tonal && *nb > 0 && last->tonal && grid - last->grid < PSY_GRID_STEPS / 2) {
+        if (power > last->power) {
+            last->power = power;
+            last->grid = grid;
+        }
+        return;
+    }
+    maskers[*nb].power = power;
+    maskers[*nb].grid = grid;
+    maskers[*nb].tonal = tonal;
+    (*nb)++;
+}
+
+/* Model 1 analysis of a channel, once filter() has read the samples of
+   the frame into samples_buf, where sample i is at SAMPLES_RING_SIZE +
+   31 - i, and before frame_end() updates the history: the window covers
+   the 448 samples preceding the frame and its first 576 ones, to be
+   centered on its subband samples which lag the input by the 481
+   samples of the filter bank. */
+static void psy_analyze(MpegAudioContext *s, int ch)
+{
+    const short *samples = s->frame->samples_buf[ch] + SAMPLES_RING_SIZE + 31;
+    float x[PSY_FFT_SIZE];
+    float power[PSY_FFT_SIZE / 2], rest[PSY_FFT_SIZE / 2];
+    float band[PSY_GRID_SIZE / PSY_GRID_STEPS + 1];
+    PsyMasker maskers[PSY_FFT_SIZE / 4 + PSY_GRID_SIZE / PSY_GRID_STEPS + 1];
+    /* the previous samples, most recent first */
+    const short *hist = s->chan[ch].samples_hist;
+    int i, j, k, nb, range, nb_bins;
+
+    for(i=0;i<PSY_FFT_SIZE-MPA_FRAME_SIZE/2;i++)
+        x[i] = hist[PSY_FFT_SIZE - MPA_FRAME_SIZE / 2 - 1 - i] * psy_window[i];
+    for(j=0;i<PSY_FFT_SIZE;i++,j++)
+        x[i] = samples[-j] * psy_window[i];
+    psy_power_spectrum(power, x);
+
+    /* tonal maskers: local maxima 7 dB over their neighbours */
+    nb = 0;
+    nb_bins = FFMIN(16 * s->max_sblimit, 500);
+    memcpy(rest, power, sizeof(rest));
+    for(k=2;k<nb_bins;k++) {
+        float p = power[k];
+        if (p <= power[k - 1] || p < power[k + 1])
+            continue;
+        range = k < 63 ? 2 : k < 127 ? 3 : k < 255 ? 6 : 12;
+        for(j=2;j<=range;j++) {
+            if (p < 5.0119f * power[k - j] || p < 5.0119f * power[k + j])
+                break;
+        }
+        if (j <= range)
+            continue;
+        psy_add_masker(s, maskers, &nb, power[k - 1] + p + power[k + 1],
+                       s->psy->bin_grid[k], 1);
+        for(j=-range;j<=range;j++)
+            rest[k + j] = 0;
+    }
+
+    /* one noise masker with the remaining power of each critical band */
+    memset(band, 0, sizeof(band));
+    for(k=1;k<nb_bins;k++)
+        band[s->psy->bin_grid[k] / PSY_GRID_STEPS] += rest[k];
+    for(i=0;i<=(s->psy->nb_grid-1)/PSY_GRID_STEPS;i++) {
+        if (band[i] > 0)
+            psy_add_masker(s, maskers, &nb, band[i],
+                           FFMIN(i * PSY_GRID_STEPS + PSY_GRID_STEPS / 2, s->psy->nb_grid - 1), 0);
+    }
+
+    psy_mask_subbands(s, ch, maskers, nb);
+
+    for(i=0;i<s->max_sblimit;i++) {
+        float v = 0;
+        for(k=16*i;k<16*i+16;k++)
+            v = FFMAX(v, power[k]);
+        s->frame->psy_level[ch][i] = v;
+    }
+}
+
+/* Cheaper model without FFT: the power of each subband is a tonal masker
+   at its center. The tonal masking index errs on the side of more bits. */
+static void psy_analyze_subbands(MpegAudioContext *s, int ch)
+{
+    PsyMasker maskers[SBLIMIT];
+    int i, k, l, nb;
+
+    nb = 0;
+    for(i=0;i<s->max_sblimit;i++) {
+        float v = 0;
+        for(k=0;k<3;k++) {
+            for(l=0;l<12;l++) {
+                float a = s->frame->sb_samples[ch][k][l][i];
+                v += a * a;
+            }
+        }
+        /* the subband samples of a sine of amplitude a have a mean square
+           of a^2 / 2 with a scale factor of 1 << 20, its tonal masker in
+           the spectrum a power of a^2 / 4 */
+        v *= 1.0f / (36 * 2 * 1048576.0f * 1048576.0f);
+        s->frame->psy_level[ch][i] = v;
+        if (v >= s->psy->ath[s->psy->sb_grid[i][0]]) {
+            maskers[nb].power = v;
+            maskers[nb].grid = (s->psy->sb_grid[i][0] + s->psy->sb_grid[i][1] + 1) >> 1;
+            maskers[nb].tonal = 1;
+            nb++;
+        }
+    }
+    psy_mask_subbands(s, ch, maskers, nb);
+}
+
+/* The most important function : psycho acoustic module. The signal to
+   mask ratio of each subband is in dB multiplied by 10. */
+static void psycho_acoustic_model(MpegAudioContext *s, int ch, short smr[SBLIMIT])
+{
+    const unsigned char *sf;
+    float v;
+    int i;
+
+    if (s->psy_model == MPA_PSY_FIXED) {
+        for(i=0;i<s->max_sblimit;i++) {
+            smr[i] = (int)(fixed_smr[i] * 10);
+        }
+        return;
+    }
+    if (s->psy_model == MPA_PSY_SUBBAND)
+        psy_analyze_subbands(s, ch);
+
+    for(i=0;i<s->max_sblimit;i++) {
+        /* the level of the subband is at least the one of its scale factor */
+        sf = s->frame->scale_factors[ch][i];
+        v = FFMAX(s->frame->psy_level[ch][i], psy_scf_power[FFMIN(FFMIN(sf[0], sf[1]), sf[2])]);
+        v = 100 * log10f(v / s->frame->psy_mask[ch][i]);
+        v = FFMAX(FFMIN(v, PSY_SMR_MAX), -PSY_SMR_MAX);
+        smr[i] = lrintf(v);
+    }
+}
+
+
+/* The subbands which can still get more bits are kept in a max-heap.
+   The key orders them by smr and then, for equal smr, by channel and
+   subband like a linear scan would. */
+#define ALLOC_KEY(smr, idx) ((smr) * 64 + 63 - (idx))
+#define ALLOC_IDX(key)      (63 - ((key) & 63))
+
+static av_always_inline void alloc_heap_down(int *heap, int n, int i)
+{
+    int key = heap[i];
+    int c;
+
+    while ((c = 2 * i + 1) < n) {
+        if (c + 1 < n && heap[c + 1] > heap[c])
+            c++;
+        if (heap[c] <= key)
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = key;
+}
+
+/* size of the next frame in bits, with its padding slot if any */
+static int frame_bit_budget(MpegAudioContext *s)
+{
+    int max_frame_size = s->frame_size;
+
+#if FRAC_PADDING
+    s->frame_frac += s->frame_frac_incr;
+    if (s->frame_frac >= PADDING_FRAC) {
+        s->frame_frac -= PADDING_FRAC;
+        s->do_padding = 1;
+        max_frame_size += 8;
+    } else {
+        s->do_padding = 0;
+    }
+#else
+    s->do_padding = 0;
+#endif
+    return max_frame_size;
+}
+
+/* Try to maximize the smr while using a number of bits inferior to
+   the frame size. I tried to make the code simpler, faster and
+   smaller than other encoders :-)
+   From the subband bound on, the channels share their bit allocation
+   and samples (intensity stereo); bound is s->sblimit otherwise.
+   The allocation stops once all the smr are down to target, INT_MIN
+   fills the frame. If curve is not NULL, it receives the frame size at
+   which the smr get down to each RC_CURVE_NMR().
+   Returns the largest smr left over target for lack of bits, INT_MIN
+   if none. nb_channels and table are constants in each instance, see
+   frame_funcs. */
+static av_always_inline int bit_allocation_tmpl(MpegAudioContext *s,
+                                                short smr1[MPA_MAX_CHANNELS][SBLIMIT],
+                                                unsigned char bit_alloc[MPA_MAX_CHANNELS][SBLIMIT],
+                                                int max_frame_size, int bound, int target,
+                                                int *curve, int *padding,
+                                                int nb_channels, int table)
+{
+    const int sblimit = ff_mpa_sblimit_table[table];
+    const AllocDesc *d = &alloc_desc[table];
+    int i, ch, b, max_ch, max_sb, current_frame_size;
+    int incr, n, idx, smr, unmet, c = 0;
+    int heap[MPA_MAX_CHANNELS * SBLIMIT];
+    short joint_smr[SBLIMIT];
+
+    memset(bit_alloc, 0, nb_channels * SBLIMIT);
+
+    /* compute the header + bit alloc size */
+    current_frame_size = 32;
+    for(i=0;i<sblimit;i++) {
+        current_frame_size += d->bits[i] *
+                              (i < bound ? nb_channels : 1);
+    }
+
+    n = 0;
+    for(ch=0;ch<nb_channels;ch++) {
+        for(i=0;i<bound;i++)
+            heap[n++] = ALLOC_KEY(smr1[ch][i], ch * SBLIMIT + i);
+    }
+    /* a shared subband is allocated as channel 0 for the most
+       demanding of the channels */
+    for(i=bound;i<sblimit;i++) {
+        joint_smr[i] = FFMAX(smr1[0][i], smr1[1][i]);
+        heap[n++] = ALLOC_KEY(joint_smr[i], i);
+    }
+    for(i=n/2-1;i>=0;i--)
+        alloc_heap_down(heap, n, i);
+
+    unmet = INT_MIN;
+    while (n > 0) {
+        if (curve) {
+            while (c < RC_CURVE_SIZE && RC_CURVE_NMR(c) >= heap[0] >> 6)
+                curve[c++] = current_frame_size;
+        }
+        if (heap[0] >> 6 <= target)
+            break;
+#if ENCODE_STATS
+        s->stats.alloc_iterations += s->stats_enabled;
+#endif
+        /* the subband with the largest signal to mask ratio */
+        idx = ALLOC_IDX(heap[0]);
+        max_ch = idx / SBLIMIT;
+        max_sb = idx % SBLIMIT;
+        ff_dlog(NULL, "current=%d max=%d max_sb=%d max_ch=%d alloc=%d\n",
+                current_frame_size, max_frame_size, max_sb, max_ch,
+                bit_alloc[max_ch][max_sb]);
+
+        b = bit_alloc[max_ch][max_sb];
+        incr = d->incr[b + 1][max_sb];
+        if (!b) {
+            /* nothing was coded for this band: add the scale factors */
+            incr += 2 + nb_scale_factors[s->frame->scale_code[max_ch][max_sb]] * 6;
+            if (max_sb >= bound)
+                incr += 2 + nb_scale_factors[s->frame->scale_code[1][max_sb]] * 6;
+        }
+
+        if (current_frame_size + incr <= max_frame_size) {
+            /* can increase size */
+            b = ++bit_alloc[max_ch][max_sb];
+            current_frame_size += incr;
+            /* max allocation size reached ? */
+            if (b == d->max_step[max_sb]) {
+                heap[0] = heap[--n];
+            } else {
+                /* decrease smr by the resolution we added */
+                smr = max_sb >= bound ? joint_smr[max_sb] : smr1[max_ch][max_sb];
+                heap[0] = ALLOC_KEY(smr - d->snr[b][max_sb], idx);
+            }
+        } else {
+            /* cannot increase the size of this subband */
+            unmet = FFMAX(unmet, heap[0] >> 6);
+            heap[0] = heap[--n];
+        }
+        alloc_heap_down(heap, n, 0);
+    }
+    if (curve) {
+        while (c < RC_CURVE_SIZE)
+            curve[c++] = current_frame_size;
+    }
+    for(i=bound;i<sblimit;i++)
+        bit_alloc[1][i] = bit_alloc[0][i];
+    *padding = max_frame_size - current_frame_size;
+    av_assert0(*padding >= 0);
+    return unmet;
+}
+
+static int compute_bit_allocation(MpegAudioContext *s,
+                                  short smr[MPA_MAX_CHANNELS][SBLIMIT],
+                                  unsigned char bit_alloc[MPA_MAX_CHANNELS][SBLIMIT],
+                                  int max_frame_size, int bound, int target,
+                                  int *curve, int *padding)
+{
+    return s->funcs->bit_allocation(s, smr, bit_alloc, max_frame_size, bound,
+                                    target, curve, padding);
+}
+
+/* Intensity stereo, for the frames which the plain stereo allocation
+   leaves short of bits: the shared samples are the mean of the channels
+   and the largest bound (mode_ext) whose allocation satisfies all the
+   subbands is kept, down to 4. The subbands over the bound must not be
+   out of phase, which the mean would cancel. */
+static void select_joint_stereo(MpegAudioContext *s,
+                                short smr[MPA_MAX_CHANNELS][SBLIMIT],
+                                unsigned char bit_alloc[MPA_MAX_CHANNELS][SBLIMIT],
+                                int max_frame_size, int *padding)
+{
+    int *l = &s->frame->sb_samples[0][0][0][0], *r = &s->frame->sb_samples[1][0][0][0];
+    int *joint = &s->frame->sb_joint[0][0][0];
+    double el[SBLIMIT] = { 0 }, er[SBLIMIT] = { 0 }, c[SBLIMIT] = { 0 };
+    int i, j, bound, min_bound, unmet;
+
+    for(j=0;j<36*SBLIMIT;j+=SBLIMIT) {
+        for(i=0;i<SBLIMIT;i++) {
+            joint[j + i] = (l[j + i] + r[j + i]) >> 1;
+            el[i] += (double)l[j + i] * l[j + i];
+            er[i] += (double)r[j + i] * r[j + i];
+            c[i] += (double)l[j + i] * r[j + i];
+        }
+    }
+    /* correlation under -0.5 */
+    for(i=s->sblimit-1;i>=4;i--) {
+        if (c[i] < 0 && 4 * c[i] * c[i] > el[i] * er[i])
+            break;
+    }
+    min_bound = i + 1;
+    if (min_bound >= s->sblimit)
+        return;
+
+    compute_scale_factors(s, s->frame->joint_scale_code, s->frame->joint_scale_factors,
+                          s->frame->sb_joint, s->sblimit);
+    for(bound=16;bound>=FFMAX(min_bound,4);bound-=4) {
+        if (bound >= s->sblimit)
+            continue;
+        unmet = compute_bit_allocation(s, smr, bit_alloc, max_frame_size, bound,
+                                       INT_MIN, NULL, padding);
+        s->jsbound = bound;
+        if (unmet <= 0)
+            break;
+    }
+}
+
+/* quantization index of a sample, for the scale factor e */
+static av_always_inline int quantize_sample(int sample, int e, int steps)
+{
+#if USE_FLOATS
+    float a = (float)sample * s_scale_factor_inv_table[e];
+
+    return FFMIN((int)((a + 1.0) * steps * 0.5), steps - 1);
+#else
+    int shift = s_scale_factor_shift[e];
+    int mult = s_scale_factor_mult[e];
+    /* one of the two shifts is 0 */
+    int lshift = FFMAX(-shift, 0);
+    int rshift = FFMAX(shift, 0);
+    int q1;
+
+    /* divide by scale factor, normalize to P bits */
+    q1 = (int)((unsigned)sample << lshift) >> rshift;
+    q1 = (q1 * mult) >> P;
+    q1 += 1 << P;
+    q1 = FFMAX(q1, 0);
+    return FFMIN((int)((q1 * (unsigned)steps) >> (P + 1)), steps - 1);
+#endif
+}
+
+/* Quantize the samples of the subbands of one channel which have
+   steps[i] levels; the others (steps[i] == 0) are left undefined. The
+   SIMD versions do all the subbands, each in its own lane, with the
+   same integer operations as quantize_sample(). The scale factors of
+   the subbands over max_sblimit are not computed, so are not read. */
+static void quantize_c(int q[3][12][SBLIMIT], int sb_samples[3][12][SBLIMIT],
+                       unsigned char scale_factors[SBLIMIT][3], const int steps[SBLIMIT])
+{
+    int i, k, l;
+
+    for(i=0;i<SBLIMIT;i++) {
+        if (!steps[i])
+            continue;
+        for(k=0;k<3;k++) {
+            for(l=0;l<12;l++)
+                q[k][l][i] = quantize_sample(sb_samples[k][l][i], scale_factors[i][k], steps[i]);
+        }
+    }
+}
+
+#if HAVE_AVX2
+static av_target_avx2 void quantize_avx2(int q[3][12][SBLIMIT], int sb_samples[3][12][SBLIMIT],
+                                         unsigned char scale_factors[SBLIMIT][3],
+                                         const int steps[SBLIMIT])
+{
+    int lshift[SBLIMIT], rshift[SBLIMIT], mult[SBLIMIT];
+    int i, j, k, l, shift;
+
+    for(k=0;k<3;k++) {
+        for(i=0;i<SBLIMIT;i++) {
+            int e = steps[i] ? scale_factors[i][k] : 0;
+            shift = s_scale_factor_shift[e];
+            lshift[i] = FFMAX(-shift, 0);
+            rshift[i] = FFMAX(shift, 0);
+            mult[i] = s_scale_factor_mult[e];
+        }
+        for(j=0;j<SBLIMIT;j+=8) {
+            __m256i vl = _mm256_loadu_si256((const __m256i *)(lshift + j));
+            __m256i vr = _mm256_loadu_si256((const __m256i *)(rshift + j));
+            __m256i vm = _mm256_loadu_si256((const __m256i *)(mult + j));
+            __m256i vs = _mm256_loadu_si256((const __m256i *)(steps + j));
+            __m256i vmax = _mm256_sub_epi32(vs, _mm256_set1_epi32(1));
+            for(l=0;l<12;l++) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)&sb_samples[k][l][j]);
+                v = _mm256_srav_epi32(_mm256_sllv_epi32(v, vl), vr);
+                v = _mm256_srai_epi32(_mm256_mullo_epi32(v, vm), P);
+                v = _mm256_add_epi32(v, _mm256_set1_epi32(1 << P));
+                v = _mm256_max_epi32(v, _mm256_setzero_si256());
+                v = _mm256_srli_epi32(_mm256_mullo_epi32(v, vs), P + 1);
+                _mm256_storeu_si256((__m256i *)&q[k][l][j], _mm256_min_epi32(v, vmax));
+            }
+        }
+    }
+}
+#endif
+#if HAVE_NEON
+static void quantize_neon(int q[3][12][SBLIMIT], int sb_samples[3][12][SBLIMIT],
+                          unsigned char scale_factors[SBLIMIT][3], const int steps[SBLIMIT])
+{
+    int shift[SBLIMIT], mult[SBLIMIT];
+    int i, j, k, l;
+
+    for(k=0;k<3;k++) {
+        for(i=0;i<SBLIMIT;i++) {
+            int e = steps[i] ? scale_factors[i][k] : 0;
+            /* a negative shift count is an arithmetic right shift */
+            shift[i] = -s_scale_factor_shift[e];
+            mult[i] = s_scale_factor_mult[e];
+        }
+        for(j=0;j<SBLIMIT;j+=4) {
+            int32x4_t vsh = vld1q_s32(shift + j);
+            int32x4_t vm = vld1q_s32(mult + j);
+            int32x4_t vs = vld1q_s32(steps + j);
+            int32x4_t vmax = vsubq_s32(vs, vdupq_n_s32(1));
+            for(l=0;l<12;l++) {
+                int32x4_t v = vshlq_s32(vld1q_s32(&sb_samples[k][l][j]), vsh);
+                v = vshrq_n_s32(vmulq_s32(v, vm), P);
+                v = vaddq_s32(v, vdupq_n_s32(1 << P));
+                v = vmaxq_s32(v, vdupq_n_s32(0));
+                v = vreinterpretq_s32_u32(vshrq_n_u32(vmulq_u32(vreinterpretq_u32_s32(v),
+                                                                vreinterpretq_u32_s32(vs)), P + 1));
+                vst1q_s32(&q[k][l][j], vminq_s32(v, vmax));
+            }
+        }
+    }
+}
+#endif
+
+/* Pack 3 consecutive quantized samples of a subband in the order they
+   are written: either grouped in one code or 3 codes of quant_bits
+   each. */
+static av_always_inline BitBuf pack_group(const int *q, int steps, int bits)
+{
+    if (bits < 0) {
+        /* group the 3 values to save bits */
+        return q[0] + steps * (q[SBLIMIT] + steps * q[2 * SBLIMIT]);
+    }
+    return ((BitBuf)q[0] << (2 * bits)) | ((BitBuf)q[SBLIMIT] << bits) | q[2 * SBLIMIT];
+}
+
+static const MPADSPContext dsp_c = {
+    MPA_KERNELS_C, 1, idct32_blocks_c, filter_c, compute_max_abs_c, quantize_c,
+    load_samples_c, resample_c, downmix_c,
+};
+#if HAVE_SSE2
+static const MPADSPContext dsp_sse2 = {
+    MPA_KERNELS_SSE2, 4, idct32_lanes_sse2, filter_sse2, compute_max_abs_sse2, quantize_c,
+    load_samples_sse2, resample_sse2, downmix_sse2,
+};
+#endif
+#if HAVE_AVX2
+static const MPADSPContext dsp_avx2 = {
+    MPA_KERNELS_AVX2, 8, idct32_lanes_avx2, filter_avx2, compute_max_abs_avx2, quantize_avx2,
+#if HAVE_SSE2
+    load_samples_sse2,
+#else
+    load_samples_c,
+#endif
+    resample_avx2, downmix_avx2,
+};
+#endif
+#if HAVE_NEON
+static const MPADSPContext dsp_neon = {
+    MPA_KERNELS_NEON, 4, idct32_lanes_neon, filter_neon, compute_max_abs_neon, quantize_neon,
+    load_samples_neon, resample_neon, downmix_neon,
+};
+#endif
+
+/* names of MPAKernels, for the MP2EN_KERNELS environment variable */
+static const char * const kernels_names[MPA_KERNELS_NB] = {
+    "auto", "c", "sse2", "avx2", "neon",
+};
+
+/* the kernels built which the CPU can run */
+static const MPADSPContext *dsp_get(int kernels)
+{
+    switch (kernels) {
+    case MPA_KERNELS_C:
+        return &dsp_c;
+#if HAVE_SSE2
+    case MPA_KERNELS_SSE2:
+        return &dsp_sse2;
+#endif
+#if HAVE_AVX2
+    case MPA_KERNELS_AVX2:
+#if !defined(__AVX2__) && (defined(__GNUC__) || defined(__clang__))
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("avx2"))
+            return NULL;
+#endif
+        return &dsp_avx2;
+#endif
+#if HAVE_NEON
+    case MPA_KERNELS_NEON:
+        return &dsp_neon;
+#endif
+    }
+    return NULL;
+}
+
+/* avctx->kernels, or else the MP2EN_KERNELS environment variable, forces
+   a set of kernels; by default the last one in MPAKernels order that the
+   CPU runs is taken. avctx->kernels is set to the one selected. */
+static av_cold int dsp_init(AVCodecContext *avctx)
+{
+    MpegAudioContext *s = avctx->priv_data;
+    int kernels = avctx->kernels;
+    const char *env;
+
+    if (kernels < 0 || kernels >= MPA_KERNELS_NB) {
+        av_log(avctx, AV_LOG_ERROR, "kernels %d do not exist\n", kernels);
+        return AVERROR(EINVAL);
+    }
+    if (kernels == MPA_KERNELS_AUTO && (env = getenv("MP2EN_KERNELS")) && *env) {
+        for(kernels=0;kernels<MPA_KERNELS_NB;kernels++) {
+            if (!strcmp(env, kernels_names[kernels]))
+                break;
+        }
+        if (kernels == MPA_KERNELS_NB) {
+            av_log(avctx, AV_LOG_ERROR, "unknown kernels %s\n", env);
+            return AVERROR(EINVAL);
+        }
+    }
+    if (kernels == MPA_KERNELS_AUTO) {
+        for(kernels=MPA_KERNELS_NB-1;kernels>MPA_KERNELS_C;kernels--) {
+            if (dsp_get(kernels))
+                break;
+        }
+    }
+    s->dsp = dsp_get(kernels);
+    if (!s->dsp) {
+        av_log(avctx, AV_LOG_ERROR, "%s kernels are not available\n", kernels_names[kernels]);
+        return AVERROR(EINVAL);
+    }
+    avctx->kernels = kernels;
+    return 0;
+}
+
+/*
+ * Output the MPEG audio layer 2 frame. Note how the code is small
+ * compared to other encoders :-)
+ * nb_channels and table are constants in each instance, see frame_funcs.
+ */
+static av_always_inline void encode_frame_tmpl(MpegAudioContext *s,
+                                               unsigned char bit_alloc[MPA_MAX_CHANNELS][SBLIMIT],
+                                               int padding, int nb_channels, int table)
+{
+    const int sblimit = ff_mpa_sblimit_table[table];
+    const AllocDesc *d = &alloc_desc[table];
+    int i, k, l, b, ch, bound = s->jsbound;
+    unsigned char *sf;
+    PutBitContext *p = &s->pb;
+    /* the shared samples of intensity stereo are the last channel */
+    int q[MPA_MAX_CHANNELS + 1][3][12][SBLIMIT];
+    int steps[MPA_MAX_CHANNELS + 1][SBLIMIT];
+    uint32_t header = s->header | (s->bitrate_index << 12) | (s->do_padding << 9);
+
+    /* header */
+
+    if (bound < sblimit)
+        header |= (MPA_JSTEREO << 6) | ((bound / 4 - 1) << 4); /* mode_ext */
+    put_bits(p, 32, header);
+
+    /* bit allocation */
+    for(i=0;i<sblimit;i++) {
+        for(ch=0;ch<(i < bound ? nb_channels : 1);ch++) {
+            put_bits(p, d->bits[i], bit_alloc[ch][i]);
+        }
+    }
+
+    /* scale codes */
+    for(i=0;i<sblimit;i++) {
+        for(ch=0;ch<nb_channels;ch++) {
+            if (bit_alloc[ch][i])
+                put_bits(p, 2, s->frame->scale_code[ch][i]);
+        }
+    }
+
+    /* scale factors */
+    for(i=0;i<sblimit;i++) {
+        for(ch=0;ch<nb_channels;ch++) {
+            if (bit_alloc[ch][i]) {
+                sf = &s->frame->scale_factors[ch][i][0];
+                switch(s->frame->scale_code[ch][i]) {
+                case 0:
+                    put_bits(p, 18, (sf[0] << 12) | (sf[1] << 6) | sf[2]);
+                    break;
+                case 3:
+                case 1:
+                    put_bits(p, 12, (sf[0] << 6) | sf[2]);
+                    break;
+                case 2:
+                    put_bits(p, 6, sf[0]);
+                    break;
+                }
+            }
+        }
+    }
+
+    /* quantization */
+    memset(steps, 0, sizeof(steps));
+    for(i=0;i<sblimit;i++) {
+        for(ch=0;ch<nb_channels;ch++) {
+            b = bit_alloc[ch][i];
+            if (b)
+                steps[i < bound ? ch : MPA_MAX_CHANNELS][i] = d->steps[b][i];
+        }
+    }
+    for(ch=0;ch<nb_channels;ch++)
+        s->dsp->quantize(q[ch], s->frame->sb_samples[ch], s->frame->scale_factors[ch], steps[ch]);
+    if (bound < sblimit)
+        s->dsp->quantize(q[MPA_MAX_CHANNELS], s->frame->sb_joint, s->frame->joint_scale_factors,
+                         steps[MPA_MAX_CHANNELS]);
+
+    /* write sub band samples */
+    for(k=0;k<3;k++) {
+        for(l=0;l<12;l+=3) {
+            for(i=0;i<bound;i++) {
+                for(ch=0;ch<nb_channels;ch++) {
+                    b = bit_alloc[ch][i];
+                    if (b) {
+                        /* we encode 3 sub band samples of the same sub band at a time */
+                        put_bits64(p, d->group_bits[b][i],
+                                   pack_group(&q[ch][k][l][i], d->steps[b][i],
+                                              d->quant_bits[b][i]));
+                    }
+                }
+            }
+            /* the shared samples of intensity stereo */
+            for(;i<sblimit;i++) {
+                b = bit_alloc[0][i];
+                if (b) {
+                    put_bits64(p, d->group_bits[b][i],
+                               pack_group(&q[MPA_MAX_CHANNELS][k][l][i], d->steps[b][i],
+                                          d->quant_bits[b][i]));
+                }
+            }
+        }
+    }
+
+    /* padding */
+    put_bits_zero(p, padding);
+
+    /* flush */
+    flush_put_bits(p);
+}
+
+static void encode_frame(MpegAudioContext *s,
+                         unsigned char bit_alloc[MPA_MAX_CHANNELS][SBLIMIT],
+                         int padding)
+{
+    s->funcs->encode(s, bit_alloc, padding);
+}
+
+/* one instance of the allocation and the packing per number of channels
+   and allocation table: the loops over the subbands and the channels get
+   constant trip counts and the descriptors of the table a constant address */
+#define FRAME_FUNCS(nb_channels, table)                                              \
+static int bit_allocation_ ## nb_channels ## _ ## table(MpegAudioContext *s,         \
+        short smr[MPA_MAX_CHANNELS][SBLIMIT],                                        \
+        unsigned char bit_alloc[MPA_MAX_CHANNELS][SBLIMIT],                          \
+        int max_frame_size, int bound, int target, int *curve, int *padding)         \
+{                                                                                    \
+    return bit_allocation_tmpl(s, smr, bit_alloc, max_frame_size, bound, target,     \
+                               curve, padding, nb_channels, table);                  \
+}                                                                                    \
+static void encode_frame_ ## nb_channels ## _ ## table(MpegAudioContext *s,          \
+        unsigned char bit_alloc[MPA_MAX_CHANNELS][SBLIMIT], int padding)             \
+{                                                                                    \
+    encode_frame_tmpl(s, bit_alloc, padding, nb_channels, table);                    \
+}
+
+FRAME_FUNCS(1, 0)
+FRAME_FUNCS(1, 1)
+FRAME_FUNCS(1, 2)
+FRAME_FUNCS(1, 3)
+FRAME_FUNCS(1, 4)
+FRAME_FUNCS(2, 0)
+FRAME_FUNCS(2, 1)
+FRAME_FUNCS(2, 2)
+FRAME_FUNCS(2, 3)
+FRAME_FUNCS(2, 4)
+
+#define FRAME_FUNCS_ENTRY(nb_channels, table) \
+    { bit_allocation_ ## nb_channels ## _ ## table, encode_frame_ ## nb_channels ## _ ## table }
+
+static const MPAFrameFuncs frame_funcs[MPA_MAX_CHANNELS][5] = {
+    {
+        FRAME_FUNCS_ENTRY(1, 0), FRAME_FUNCS_ENTRY(1, 1), FRAME_FUNCS_ENTRY(1, 2),
+        FRAME_FUNCS_ENTRY(1, 3), FRAME_FUNCS_ENTRY(1, 4),
+    },
+    {
+        FRAME_FUNCS_ENTRY(2, 0), FRAME_FUNCS_ENTRY(2, 1), FRAME_FUNCS_ENTRY(2, 2),
+        FRAME_FUNCS_ENTRY(2, 3), FRAME_FUNCS_ENTRY(2, 4),
+    },
+};
+
+
+#if ENCODE_STATS
+static av_always_inline uint64_t read_time(void)
+{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+    return __rdtsc();
+#elif defined(__i386__) || defined(__x86_64__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static void update_stage_cycles(MpegAudioContext *s, const uint64_t t[MPA_STAGE_NB + 1],
+                                int first, int last)
+{
+    int i;
+
+    for(i=first;i<last;i++)
+        s->stats.stage_cycles[i] += t[i + 1] - t[i];
+}
+
+static void update_stats(MpegAudioContext *s,
+                         unsigned char bit_alloc[MPA_MAX_CHANNELS][SBLIMIT],
+                         int padding)
+{
+    MPAEncodeStats *st = &s->stats;
+    int i, ch;
+
+    st->frames++;
+    st->padding_bits += padding;
+    st->last_padding_bits = padding;
+    for(ch=0;ch<s->nb_channels;ch++) {
+        for(i=0;i<s->sblimit;i++) {
+            if (bit_alloc[ch][i]) {
+                st->subbands_allocated++;
+                st->scale_code_hist[s->frame->scale_code[ch][i]]++;
+            }
+        }
+    }
+}
+
+#define STAGE_TIME(i) do { if (s->stats_enabled) t[i] = read_time(); } while (0)
+#else
+#define STAGE_TIME(i) do {} while (0)
+#endif
+
+/* Start a frame in f: the ring of the filter bank starts over from the
+   history of the context, at offset 0 where it ends once round. */
+static void frame_begin(MpegAudioContext *s, MPAFrame *f)
+{
+    int ch;
+
+    s->frame = f;
+    for(ch=0;ch<s->nb_channels;ch++) {
+        memcpy(f->samples_buf[ch] + 32, s->chan[ch].samples_hist,
+               SAMPLES_HIST_SIZE * sizeof(s->chan[ch].samples_hist[0]));
+        memcpy(f->samples_buf[ch] + SAMPLES_RING_SIZE + 32, s->chan[ch].samples_hist,
+               (SAMPLES_HIST_SIZE - 32) * sizeof(s->chan[ch].samples_hist[0]));
+        f->samples_offset[ch] = 0;
+    }
+}
+
+/* keep the history of the frame, once filtered */
+static void frame_end(MpegAudioContext *s)
+{
+    int ch;
+
+    for(ch=0;ch<s->nb_channels;ch++)
+        memcpy(s->chan[ch].samples_hist, s->frame->samples_buf[ch] + 32,
+               SAMPLES_HIST_SIZE * sizeof(s->chan[ch].samples_hist[0]));
+    s->rs_out += MPA_FRAME_SIZE;
+}
+
+/* filter bank, scale factors and signal to mask ratios of the frame begun
+   with frame_begin(), and with MPA_RC_ABR the bits it needs in rc_curve;
+   in is moved on past the samples of the frame */
+static void analyze_frame(MpegAudioContext *s, MPAInput *in,
+                          short smr[MPA_MAX_CHANNELS][SBLIMIT])
+{
+    unsigned char bit_alloc[MPA_MAX_CHANNELS][SBLIMIT];
+    int padding, i;
+#if ENCODE_STATS
+    uint64_t t[MPA_STAGE_NB + 1] = { 0 };
+#endif
+
+    STAGE_TIME(MPA_STAGE_FILTER);
+    for(i=0;i<s->nb_channels;i++) {
+        s->dsp->filter(s, i, in);
+    }
+
+    STAGE_TIME(MPA_STAGE_PSY);
+    if (s->psy_model == MPA_PSY_MODEL1) {
+        for(i=0;i<s->nb_channels;i++)
+            psy_analyze(s, i);
+    }
+
+    STAGE_TIME(MPA_STAGE_SCALE);
+    for(i=0;i<s->nb_channels;i++) {
+        compute_scale_factors(s, s->frame->scale_code[i], s->frame->scale_factors[i],
+                              s->frame->sb_samples[i], s->max_sblimit);
+    }
+    for(i=0;i<s->nb_channels;i++) {
+        psycho_acoustic_model(s, i, smr[i]);
+    }
+
+    STAGE_TIME(MPA_STAGE_ALLOC);
+    if (s->rc_mode == MPA_RC_ABR) {
+        set_bitrate(s, s->bitrates[s->nb_bitrates - 1]);
+        compute_bit_allocation(s, smr, bit_alloc, s->frame_size, s->sblimit,
+                               INT_MIN, s->frame->rc_curve, &padding);
+    }
+    STAGE_TIME(MPA_STAGE_ENCODE);
+
+#if ENCODE_STATS
+    if (s->stats_enabled)
+        update_stage_cycles(s, t, MPA_STAGE_FILTER, MPA_STAGE_ENCODE);
+#endif
+}
+
+/* MPA_RC_ABR: the lowest noise to mask ratio at which the frames of the
+   window, the next one first, fit in their share of the mean bitrate
+   and of the saved bits */
+static int rc_abr_target(MpegAudioContext *s, const int *curves[], int nb)
+{
+    int64_t budget, bits;
+    int c, i;
+
+    budget = (int64_t)nb * (s->rc_frame_bits + s->rc_reservoir / RC_SPREAD_FRAMES);
+    for(c=RC_CURVE_SIZE-1;c>0;c--) {
+        bits = 0;
+        for(i=0;i<nb;i++)
+            bits += curves[i][c];
+        if (bits <= budget)
+            break;
+    }
+    return RC_CURVE_NMR(c);
+}
+
+/* the largest smr of the subbands from the sblimit of the current
+   bitrate up to max_sblimit, which its allocation table leaves out */
+static int smr_over_sblimit(MpegAudioContext *s, short smr[MPA_MAX_CHANNELS][SBLIMIT])
+{
+    int ch, i, v = INT_MIN;
+
+    for(ch=0;ch<s->nb_channels;ch++) {
+        for(i=s->sblimit;i<s->max_sblimit;i++)
+            v = FFMAX(v, smr[ch][i]);
+    }
+    return v;
+}
+
+/* the smallest bitrate whose allocation brings all the smr down to
+   target, or the largest one. The subbands over the sblimit of a bitrate
+   count as unmet, or the low bitrates, whose tables stop at 8 or 12
+   subbands, would meet any target by dropping the treble. */
+static void select_bitrate(MpegAudioContext *s,
+                           short smr[MPA_MAX_CHANNELS][SBLIMIT],
+                           unsigned char bit_alloc[MPA_MAX_CHANNELS][SBLIMIT],
+                           int target)
+{
+    int lo = 0, hi = s->nb_bitrates - 1, mid, padding;
+
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        set_bitrate(s, s->bitrates[mid]);
+        if (smr_over_sblimit(s, smr) <= target &&
+            compute_bit_allocation(s, smr, bit_alloc, s->frame_size, s->sblimit,
+                                   target, NULL, &padding) == INT_MIN)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    set_bitrate(s, s->bitrates[lo]);
+}
+
+/* bit allocation and bitstream of the analysed frame; target is the
+   noise to mask ratio of the variable bitrate modes */
+static void code_frame(MpegAudioContext *s, short smr[MPA_MAX_CHANNELS][SBLIMIT],
+                       int target)
+{
+    unsigned char bit_alloc[MPA_MAX_CHANNELS][SBLIMIT];
+    int padding, max_frame_size, unmet;
+#if ENCODE_STATS
+    uint64_t t[MPA_STAGE_NB + 1] = { 0 };
+#endif
+
+    STAGE_TIME(MPA_STAGE_ALLOC);
+    if (s->rc_mode == MPA_RC_CBR) {
+        max_frame_size = frame_bit_budget(s);
+    } else {
+        /* the frame is then filled, which costs nothing */
+        select_bitrate(s, smr, bit_alloc, target);
+        s->do_padding = 0;
+        max_frame_size = s->frame_size;
+    }
+    s->jsbound = s->sblimit;
+    unmet = compute_bit_allocation(s, smr, bit_alloc, max_frame_size, s->sblimit,
+                                   INT_MIN, NULL, &padding);
+    if (s->joint_stereo && unmet > 0)
+        select_joint_stereo(s, smr, bit_alloc, max_frame_size, &padding);
+    if (s->rc_mode == MPA_RC_ABR) {
+        int64_t reservoir = (int64_t)RC_RESERVOIR_FRAMES * s->rc_frame_bits;
+        s->rc_reservoir += s->rc_frame_bits - s->frame_size;
+        s->rc_reservoir = (int)FFMAX(FFMIN(s->rc_reservoir, reservoir), -reservoir);
+    }
+
+    STAGE_TIME(MPA_STAGE_ENCODE);
+    encode_frame(s, bit_alloc, padding);
+    STAGE_TIME(MPA_STAGE_NB);
+
+#if ENCODE_STATS
+    if (s->stats_enabled) {
+        update_stage_cycles(s, t, MPA_STAGE_ALLOC, MPA_STAGE_NB);
+        update_stats(s, bit_alloc, padding);
+    }
+#endif
+}
+
+static void encode_samples(MpegAudioContext *s, MPAInput *in)
+{
+    short smr[MPA_MAX_CHANNELS][SBLIMIT];
+    MPAFrame frame;
+    const int *curve = frame.rc_curve;
+
+    frame_begin(s, &frame);
+    analyze_frame(s, in, smr);
+    frame_end(s);
+    code_frame(s, smr, s->rc_mode == MPA_RC_ABR ? rc_abr_target(s, &curve, 1) : s->rc_target);
+    s->frame = NULL;
+}
+
+/* a frame of the MPA_RC_ABR lookahead, from analyze_frame() */
+typedef struct RCFrame {
+    int sb_samples[MPA_MAX_CHANNELS][3][12][SBLIMIT];
+    unsigned char scale_factors[MPA_MAX_CHANNELS][SBLIMIT][3];
+    unsigned char scale_code[MPA_MAX_CHANNELS][SBLIMIT];
+    short smr[MPA_MAX_CHANNELS][SBLIMIT];
+    int curve[RC_CURVE_SIZE];
+} RCFrame;
+
+/* analyse the frame of in into f, which keeps it until it is coded */
+static void rc_analyze(MpegAudioContext *s, RCFrame *f, MPAInput *in)
+{
+    MPAFrame frame;
+
+    frame_begin(s, &frame);
+    analyze_frame(s, in, f->smr);
+    frame_end(s);
+    memcpy(f->sb_samples, frame.sb_samples, sizeof(f->sb_samples));
+    memcpy(f->scale_factors, frame.scale_factors, sizeof(f->scale_factors));
+    memcpy(f->scale_code, frame.scale_code, sizeof(f->scale_code));
+    memcpy(f->curve, frame.rc_curve, sizeof(f->curve));
+    s->frame = NULL;
+}
+
+/* code the analysed frame f; curves are the ones of f and of the nb - 1
+   frames analysed after it */
+static void rc_code(MpegAudioContext *s, RCFrame *f, const int *curves[], int nb)
+{
+    MPAFrame frame;
+
+    s->frame = &frame;
+    memcpy(frame.sb_samples, f->sb_samples, sizeof(frame.sb_samples));
+    memcpy(frame.scale_factors, f->scale_factors, sizeof(frame.scale_factors));
+    memcpy(frame.scale_code, f->scale_code, sizeof(frame.scale_code));
+    code_frame(s, f->smr, rc_abr_target(s, curves, nb));
+    s->frame = NULL;
+}
+
+/* Encode frame n of a batch of nb_frames with MPA_RC_ABR, once the
+   frames up to RC_LOOKAHEAD after it are analysed. The window holds
+   the analysis of frames *nb_analyzed - RC_LOOKAHEAD - 1 onwards, and
+   in points to the samples of frame *nb_analyzed. */
+static void encode_samples_lookahead(MpegAudioContext *s, RCFrame window[RC_LOOKAHEAD + 1],
+                                     MPAInput *in, int n, int nb_frames, int *nb_analyzed)
+{
+    const int *curves[RC_LOOKAHEAD + 1];
+    int i;
+
+    for(;*nb_analyzed<nb_frames && *nb_analyzed<=n+RC_LOOKAHEAD;(*nb_analyzed)++)
+        rc_analyze(s, &window[*nb_analyzed % (RC_LOOKAHEAD + 1)], in);
+    for(i=n;i<*nb_analyzed;i++)
+        curves[i - n] = window[i % (RC_LOOKAHEAD + 1)].curve;
+    rc_code(s, &window[n % (RC_LOOKAHEAD + 1)], curves, *nb_analyzed - n);
+}
+
+static int encode_frame_fmt(AVCodecContext *avctx, int fmt, const void * const *data,
+                            uint8_t *encoded)
+{
+    MpegAudioContext *s = avctx->priv_data;
+    MPAInput in;
+    //const int16_t *samples = (const int16_t *)frame->data[0];
+
+    //if ((ret = ff_alloc_packet2(avctx, avpkt, MPA_MAX_CODED_FRAME_SIZE, 0)) < 0)
+    //    return ret;
+    //avpkt->data = MPA_encoded;
+    //avpkt->size = sizeof(MPA_encoded);
+
+    init_put_bits(&s->pb, encoded, MPA_MAX_CODED_FRAME_SIZE);
+
+    input_init(s, &in, fmt, data);
+    encode_samples(s, &in);
+
+    //if (frame->pts != AV_NOPTS_VALUE)
+    //    avpkt->pts = frame->pts - ff_samples_to_time_base(avctx, avctx->initial_padding);
+
+    //avpkt->size = put_bits_count(&s->pb) / 8;
+    //*got_packet_ptr = 1;
+    return put_bits_count(&s->pb) / 8;
+}
+
+int MPA_encode_frame(AVCodecContext *avctx, int16_t* samples, uint8_t *encoded)
+{
+    const void *data[1] = { samples };
+
+    return encode_frame_fmt(avctx, MPA_SAMPLE_FMT_S16, data, encoded);
+}
+
+int MPA_encode_frame_data(AVCodecContext *avctx, const void * const *data, uint8_t *encoded)
+{
+    MpegAudioContext *s = avctx->priv_data;
+
+    return encode_frame_fmt(avctx, s->sample_fmt, data, encoded);
+}
+
+int MPA_encode_max_frame_size(AVCodecContext *avctx)
+{
+    MpegAudioContext *s = avctx->priv_data;
+
+    int size = frame_bits(s, s->bitrates[s->nb_bitrates - 1]) / 8;
+
+#if FRAC_PADDING
+    if (s->rc_mode == MPA_RC_CBR)
+        size++; /* padding slot */
+#endif
+    return size;
+}
+
+int MPA_encode_input_size(AVCodecContext *avctx, int nb_frames)
+{
+    MpegAudioContext *s = avctx->priv_data;
+
+    if (!s->rs)
+        return nb_frames * MPA_FRAME_SIZE;
+    return (int)(resample_input_pos(s->rs, s->rs_out + (int64_t)nb_frames * MPA_FRAME_SIZE) -
+                 resample_input_pos(s->rs, s->rs_out));
+}
+
+static int encode_frames_fmt(AVCodecContext *avctx, int fmt, const void * const *data,
+                             int nb_frames, uint8_t *encoded, int encoded_size,
+                             int *frame_sizes, int *frame_offsets)
+{
+    MpegAudioContext *s = avctx->priv_data;
+    int max_frame_bytes = MPA_encode_max_frame_size(avctx);
+    RCFrame *window = NULL;
+    MPAInput in;
+    int n, pos, nb_analyzed = 0;
+
+
+    if (nb_frames < 0 || encoded_size < 0)
+        return AVERROR(EINVAL);
+
+    if (s->rc_mode == MPA_RC_ABR) {
+        /* the frames analysed ahead cannot be taken back, so only encode
+           what is sure to fit */
+        if (nb_frames > encoded_size / max_frame_bytes)
+            nb_frames = encoded_size / max_frame_bytes;
+        window = malloc((RC_LOOKAHEAD + 1) * sizeof(*window));
+        if (!window)
+            return AVERROR(ENOMEM);
+    }
+
+    /* frames are byte aligned, so one bit writer covers the whole batch */
+    init_put_bits(&s->pb, encoded, encoded_size);
+    input_init(s, &in, fmt, data);
+
+    pos = 0;
+    for(n=0;n<nb_frames;n++) {
+        if (encoded_size - pos < max_frame_bytes)
+            break;
+        if (window)
+            encode_samples_lookahead(s, window, &in, n, nb_frames, &nb_analyzed);
+        else
+            encode_samples(s, &in);
+
+        if (frame_offsets)
+            frame_offsets[n] = pos;
+        if (frame_sizes)
+            frame_sizes[n] = put_bits_count(&s->pb) / 8 - pos;
+        pos = put_bits_count(&s->pb) / 8;
+    }
+    free(window);
+    return n;
+}
+
+int MPA_encode_frames(AVCodecContext *avctx, const int16_t *samples, int nb_frames,
+                      uint8_t *encoded, int encoded_size,
+                      int *frame_sizes, int *frame_offsets)
+{
+    const void *data[1] = { samples };
+
+    return encode_frames_fmt(avctx, MPA_SAMPLE_FMT_S16, data, nb_frames, encoded,
+                             encoded_size, frame_sizes, frame_offsets);
+}
+
+int MPA_encode_frames_data(AVCodecContext *avctx, const void * const *data, int nb_frames,
+                           uint8_t *encoded, int encoded_size,
+                           int *frame_sizes, int *frame_offsets)
+{
+    MpegAudioContext *s = avctx->priv_data;
+
+    return encode_frames_fmt(avctx, s->sample_fmt, data, nb_frames, encoded,
+                             encoded_size, frame_sizes, frame_offsets);
+}
+
+/* Input of MPA_encode_push() short of a frame, in sample_fmt: interleaved,
+   or one plane of capacity samples per channel. With MPA_RC_ABR, also the
+   frames analysed but not coded yet, window[first] onwards. */
+typedef struct MPAFifo {
+    uint8_t *buf;
+    int capacity;       /* samples per channel, the most a frame reads */
+    int nb_samples;     /* samples per channel buffered */
+    int64_t start;      /* rs_out at the start of the stream or the last flush */
+    RCFrame *window;    /* RC_LOOKAHEAD + 1 frames, NULL but with MPA_RC_ABR */
+    int first, nb_pending;
+} MPAFifo;
+
+static int fifo_get(MpegAudioContext *s, MPAFifo **fifo)
+{
+    MPAFifo *f = s->fifo;
+    int bytes = sample_fmt_bytes[s->sample_fmt] * s->nb_in_channels;
+
+    if (!f) {
+        f = calloc(1, sizeof(*f));
+        if (!f)
+            return AVERROR(ENOMEM);
+        f->capacity = MPA_FRAME_SIZE;
+        if (s->rs) {
+            /* a frame reads at most a sample more than its share of the
+               input, and the first one the half of the filter ahead */
+            f->capacity = (int)(((int64_t)MPA_FRAME_SIZE * s->rs->step + s->rs->phases - 1) /
+                                s->rs->phases) + s->rs->taps / 2 + 2;
+        }
+        f->buf = malloc((size_t)f->capacity * bytes);
+        if (s->rc_mode == MPA_RC_ABR)
+            f->window = malloc((RC_LOOKAHEAD + 1) * sizeof(*f->window));
+        if (!f->buf || (s->rc_mode == MPA_RC_ABR && !f->window)) {
+            free(f->buf);
+            free(f);
+            return AVERROR(ENOMEM);
+        }
+        s->fifo = f;
+    }
+    *fifo = f;
+    return 0;
+}
+
+/* pointers to the input at sample pos of data laid out as for
+   MPA_encode_frame_data(), or of the FIFO if data is NULL */
+static void fifo_data(MpegAudioContext *s, const void * const *data, int pos,
+                      const void **dst)
 {
-    int i;
-
-    for(i=0;i<s->sblimit;i++) {
-        smr[i] = (int)(fixed_smr[i] * 10);
+    int i, bytes = sample_fmt_bytes[s->sample_fmt];
+
+    for(i=0;i<s->nb_in_channels;i++) {
+        if (!data)
+            dst[i] = s->fifo->buf + (size_t)(sample_fmt_planar[s->sample_fmt] ? i : 0) *
+                                    s->fifo->capacity * bytes;
+        else if (sample_fmt_planar[s->sample_fmt])
+            dst[i] = (const uint8_t *)data[i] + (size_t)pos * bytes;
+        else
+            dst[i] = (const uint8_t *)data[0] + (size_t)pos * bytes * s->nb_in_channels;
     }
 }
 
-
-#define SB_NOTALLOCATED  0
-#define SB_ALLOCATED     1
-#define SB_NOMORE        2
-
-/* Try to maximize the smr while using a number of bits inferior to
-   the frame size. I tried to make the code simpler, faster and
-   smaller than other encoders :-) */
-static void compute_bit_allocation(MpegAudioContext *s,
-                                   short smr1[MPA_MAX_CHANNELS][SBLIMIT],
-                                   unsigned char bit_alloc[MPA_MAX_CHANNELS][SBLIMIT],
-                                   int *padding)
-{
-    int i, ch, b, max_smr, max_ch, max_sb, current_frame_size, max_frame_size;
-    int incr;
-    short smr[MPA_MAX_CHANNELS][SBLIMIT];
-    unsigned char subband_status[MPA_MAX_CHANNELS][SBLIMIT];
-    const unsigned char *alloc;
-
-    memcpy(smr, smr1, s->nb_channels * sizeof(short) * SBLIMIT);
-    memset(subband_status, SB_NOTALLOCATED, s->nb_channels * SBLIMIT);
-    memset(bit_alloc, 0, s->nb_channels * SBLIMIT);
-
-    /* compute frame size and padding */
-    max_frame_size = s->frame_size;
-#if FRAC_PADDING
-    s->frame_frac += s->frame_frac_incr;
-    if (s->frame_frac >= PADDING_FRAC) {
-        s->frame_frac -= PADDING_FRAC;
-        s->do_padding = 1;
-        max_frame_size += 8;
-    } else {
-        s->do_padding = 0;
+/* append n samples at pos of data to the FIFO, or silence if data is NULL */
+static void fifo_write(MpegAudioContext *s, const void * const *data, int pos, int n)
+{
+    MPAFifo *f = s->fifo;
+    const void *src[MPA_MAX_INPUT_CHANNELS];
+    int i, bytes = sample_fmt_bytes[s->sample_fmt];
+    int planes = sample_fmt_planar[s->sample_fmt] ? s->nb_in_channels : 1;
+
+    if (!sample_fmt_planar[s->sample_fmt])
+        bytes *= s->nb_in_channels;
+    if (data)
+        fifo_data(s, data, pos, src);
+    for(i=0;i<planes;i++) {
+        uint8_t *p = f->buf + ((size_t)i * f->capacity + f->nb_samples) * bytes;
+        if (data)
+            memcpy(p, src[i], (size_t)n * bytes);
+        else
+            memset(p, 0, (size_t)n * bytes); /* also 0.0 in float */
     }
-#else
-    s->do_padding = 0;
-#endif
-    /* compute the header + bit alloc size */
-    current_frame_size = 32;
-    alloc = s->alloc_table;
-    for(i=0;i<s->sblimit;i++) {
-        incr = alloc[0];
-        current_frame_size += incr * s->nb_channels;
-        alloc += 1 << incr;
-    }
-    for(;;) {
-        /* look for the subband with the largest signal to mask ratio */
-        max_sb = -1;
-        max_ch = -1;
-        max_smr = INT_MIN;
-        for(ch=0;ch<s->nb_channels;ch++) {
-            for(i=0;i<s->sblimit;i++) {
-                if (smr[ch][i] > max_smr && subband_status[ch][i] != SB_NOMORE) {
-                    max_smr = smr[ch][i];
-                    max_sb = i;
-                    max_ch = ch;
-                }
-            }
-        }
-        if (max_sb < 0)
-            break;
-        ff_dlog(NULL, "current=%d max=%d max_sb=%d max_ch=%d alloc=%d\n",
-                current_frame_size, max_frame_size, max_sb, max_ch,
-                bit_alloc[max_ch][max_sb]);
+    f->nb_samples += n;
+}
 
-        /* find alloc table entry (XXX: not optimal, should use
-           pointer table) */
-        alloc = s->alloc_table;
-        for(i=0;i<max_sb;i++) {
-            alloc += 1 << alloc[0];
-        }
+/* code the oldest frame of the MPA_RC_ABR window */
+static int push_code(MpegAudioContext *s, uint8_t *encoded)
+{
+    MPAFifo *f = s->fifo;
+    const int *curves[RC_LOOKAHEAD + 1];
+    int i;
 
-        if (subband_status[max_ch][max_sb] == SB_NOTALLOCATED) {
-            /* nothing was coded for this band: add the necessary bits */
-            incr = 2 + nb_scale_factors[s->scale_code[max_ch][max_sb]] * 6;
-            incr += s_total_quant_bits[alloc[1]];
-        } else {
-            /* increments bit allocation */
-            b = bit_alloc[max_ch][max_sb];
-            incr = s_total_quant_bits[alloc[b + 1]] -
-                s_total_quant_bits[alloc[b]];
-        }
+    for(i=0;i<f->nb_pending;i++)
+        curves[i] = f->window[(f->first + i) % (RC_LOOKAHEAD + 1)].curve;
+    init_put_bits(&s->pb, encoded, MPA_MAX_CODED_FRAME_SIZE);
+    rc_code(s, &f->window[f->first], curves, f->nb_pending);
+    f->first = (f->first + 1) % (RC_LOOKAHEAD + 1);
+    f->nb_pending--;
+    return put_bits_count(&s->pb) / 8;
+}
 
-        if (current_frame_size + incr <= max_frame_size) {
-            /* can increase size */
-            b = ++bit_alloc[max_ch][max_sb];
-            current_frame_size += incr;
-            /* decrease smr by the resolution we added */
-            smr[max_ch][max_sb] = smr1[max_ch][max_sb] - quant_snr[alloc[b]];
-            /* max allocation size reached ? */
-            if (b == ((1 << alloc[0]) - 1))
-                subband_status[max_ch][max_sb] = SB_NOMORE;
-            else
-                subband_status[max_ch][max_sb] = SB_ALLOCATED;
-        } else {
-            /* cannot increase the size of this subband */
-            subband_status[max_ch][max_sb] = SB_NOMORE;
+/* Encode nb_frames whole frames of data in sample_fmt for
+   MPA_encode_push(). With MPA_RC_ABR a frame is only coded once the
+   RC_LOOKAHEAD frames after it are analysed, whatever the calls the
+   input came in. Returns the number of frames output. */
+static int push_frames(AVCodecContext *avctx, const void * const *data, int nb_frames,
+                       uint8_t *encoded, int encoded_size, int *frame_sizes)
+{
+    MpegAudioContext *s = avctx->priv_data;
+    MPAFifo *f = s->fifo;
+    MPAInput in;
+    int i, n = 0, size = 0;
+
+    if (!f->window)
+        return encode_frames_fmt(avctx, s->sample_fmt, data, nb_frames, encoded,
+                                 encoded_size, frame_sizes, NULL);
+
+    input_init(s, &in, s->sample_fmt, data);
+    for(i=0;i<nb_frames;i++) {
+        rc_analyze(s, &f->window[(f->first + f->nb_pending) % (RC_LOOKAHEAD + 1)], &in);
+        if (++f->nb_pending > RC_LOOKAHEAD) {
+            frame_sizes[n] = push_code(s, encoded + size);
+            size += frame_sizes[n++];
         }
     }
-    *padding = max_frame_size - current_frame_size;
-    av_assert0(*padding >= 0);
+    return n;
 }
 
-/*
- * Output the MPEG audio layer 2 frame. Note how the code is small
- * compared to other encoders :-)
- */
-static void encode_frame(MpegAudioContext *s,
-                         unsigned char bit_alloc[MPA_MAX_CHANNELS][SBLIMIT],
-                         int padding)
+/* encode the frame in the FIFO, which holds its samples */
+static int fifo_encode(AVCodecContext *avctx, uint8_t *encoded, int encoded_size,
+                       int *frame_sizes)
 {
-    int i, j, k, l, bit_alloc_bits, b, ch;
-    unsigned char *sf;
-    int q[3];
-    PutBitContext *p = &s->pb;
+    MpegAudioContext *s = avctx->priv_data;
+    const void *data[MPA_MAX_INPUT_CHANNELS];
 
-    /* header */
+    fifo_data(s, NULL, 0, data);
+    s->fifo->nb_samples = 0;
+    return push_frames(avctx, data, 1, encoded, encoded_size, frame_sizes);
+}
 
-    put_bits(p, 12, 0xfff);
-    put_bits(p, 1, 1 - s->lsf); /* 1 = MPEG-1 ID, 0 = MPEG-2 lsf ID */
-    put_bits(p, 2, 4-2);  /* layer 2 */
-    put_bits(p, 1, 1); /* no error protection */
-    put_bits(p, 4, s->bitrate_index);
-    put_bits(p, 2, s->freq_index);
-    put_bits(p, 1, s->do_padding); /* use padding */
-    put_bits(p, 1, 0);             /* private_bit */
-    put_bits(p, 2, s->nb_channels == 2 ? MPA_STEREO : MPA_MONO);
-    put_bits(p, 2, 0); /* mode_ext */
-    put_bits(p, 1, 0); /* no copyright */
-    put_bits(p, 1, 1); /* original */
-    put_bits(p, 2, 0); /* no emphasis */
+int MPA_encode_push_frames(AVCodecContext *avctx, int nb_samples)
+{
+    MpegAudioContext *s = avctx->priv_data;
+    int64_t avail = (int64_t)nb_samples + (s->fifo ? s->fifo->nb_samples : 0);
+    int n = 0;
 
-    /* bit allocation */
-    j = 0;
-    for(i=0;i<s->sblimit;i++) {
-        bit_alloc_bits = s->alloc_table[j];
-        for(ch=0;ch<s->nb_channels;ch++) {
-            put_bits(p, bit_alloc_bits, bit_alloc[ch][i]);
-        }
-        j += 1 << bit_alloc_bits;
-    }
+    while (MPA_encode_input_size(avctx, n + 1) <= avail)
+        n++;
+    return n;
+}
 
-    /* scale codes */
-    for(i=0;i<s->sblimit;i++) {
-        for(ch=0;ch<s->nb_channels;ch++) {
-            if (bit_alloc[ch][i])
-                put_bits(p, 2, s->scale_code[ch][i]);
+int MPA_encode_push(AVCodecContext *avctx, const void * const *data, int nb_samples,
+                    uint8_t *encoded, int encoded_size, int *frame_sizes)
+{
+    MpegAudioContext *s = avctx->priv_data;
+    const void *src[MPA_MAX_INPUT_CHANNELS];
+    MPAFifo *f;
+    int nb_frames, n = 0, pos = 0, size = 0, i, ret;
+
+    if (nb_samples < 0 || encoded_size < 0)
+        return AVERROR(EINVAL);
+    if ((ret = fifo_get(s, &f)) < 0)
+        return ret;
+    nb_frames = MPA_encode_push_frames(avctx, nb_samples);
+    if ((int64_t)nb_frames * MPA_encode_max_frame_size(avctx) > encoded_size)
+        return AVERROR(EINVAL);
+    /* complete the frame started by the previous calls */
+    if (f->nb_samples) {
+        pos = FFMIN(MPA_encode_input_size(avctx, 1) - f->nb_samples, nb_samples);
+        fifo_write(s, data, 0, pos);
+        if (f->nb_samples == MPA_encode_input_size(avctx, 1)) {
+            if ((n = fifo_encode(avctx, encoded, encoded_size, frame_sizes)) < 0)
+                return n;
+            nb_frames--;
         }
     }
 
-    /* scale factors */
-    for(i=0;i<s->sblimit;i++) {
-        for(ch=0;ch<s->nb_channels;ch++) {
-            if (bit_alloc[ch][i]) {
-                sf = &s->scale_factors[ch][i][0];
-                switch(s->scale_code[ch][i]) {
-                case 0:
-                    put_bits(p, 6, sf[0]);
-                    put_bits(p, 6, sf[1]);
-                    put_bits(p, 6, sf[2]);
-                    break;
-                case 3:
-                case 1:
-                    put_bits(p, 6, sf[0]);
-                    put_bits(p, 6, sf[2]);
-                    break;
-                case 2:
-                    put_bits(p, 6, sf[0]);
-                    break;
-                }
-            }
-        }
+    /* the whole frames which follow are encoded from data */
+    if (nb_frames) {
+        for(i=0;i<n;i++)
+            size += frame_sizes[i];
+        fifo_data(s, data, pos, src);
+        pos += MPA_encode_input_size(avctx, nb_frames);
+        ret = push_frames(avctx, src, nb_frames, encoded + size, encoded_size - size,
+                          frame_sizes + n);
+        if (ret < 0)
+            return ret;
+        n += ret;
     }
 
-    /* quantization & write sub band samples */
+    /* and the rest waits for the next calls */
+    if (pos < nb_samples)
+        fifo_write(s, data, pos, nb_samples - pos);
+    return n;
+}
 
-    for(k=0;k<3;k++) {
-        for(l=0;l<12;l+=3) {
-            j = 0;
-            for(i=0;i<s->sblimit;i++) {
-                bit_alloc_bits = s->alloc_table[j];
-                for(ch=0;ch<s->nb_channels;ch++) {
-                    b = bit_alloc[ch][i];
-                    if (b) {
-                        int qindex, steps, m, sample, bits;
-                        /* we encode 3 sub band samples of the same sub band at a time */
-                        qindex = s->alloc_table[j+b];
-                        steps = ff_mpa_quant_steps[qindex];
-                        for(m=0;m<3;m++) {
-                            sample = s->sb_samples[ch][k][l + m][i];
-                            /* divide by scale factor */
-#if USE_FLOATS
-                            {
-                                float a;
-                                a = (float)sample * s->scale_factor_inv_table[s->scale_factors[ch][i][k]];
-                                q[m] = (int)((a + 1.0) * steps * 0.5);
-                            }
-#else
-                            {
-                                int q1, e, shift, mult;
-                                e = s->scale_factors[ch][i][k];
-                                shift = s_scale_factor_shift[e];
-                                mult = s_scale_factor_mult[e];
-
-                                /* normalize to P bits */
-                                if (shift < 0)
-                                    q1 = sample << (-shift);
-                                else
-                                    q1 = sample >> shift;
-                                q1 = (q1 * mult) >> P;
-                                q1 += 1 << P;
-                                if (q1 < 0)
-                                    q1 = 0;
-                                q[m] = (q1 * (unsigned)steps) >> (P + 1);
-                            }
-#endif
-                            if (q[m] >= steps)
-                                q[m] = steps - 1;
-                            av_assert2(q[m] >= 0 && q[m] < steps);
-                        }
-                        bits = ff_mpa_quant_bits[qindex];
-                        if (bits < 0) {
-                            /* group the 3 values to save bits */
-                            put_bits(p, -bits,
-                                     q[0] + steps * (q[1] + steps * q[2]));
-                        } else {
-                            put_bits(p, bits, q[0]);
-                            put_bits(p, bits, q[1]);
-                            put_bits(p, bits, q[2]);
-                        }
-                    }
-                }
-                /* next subband in alloc table */
-                j += 1 << bit_alloc_bits;
-            }
-        }
+int MPA_encode_flush(AVCodecContext *avctx, uint8_t *encoded, int encoded_size,
+                     int *frame_sizes, int *end_padding)
+{
+    MpegAudioContext *s = avctx->priv_data;
+    int64_t nb_in, nb_out, nb_frames, done;
+    MPAFifo *f;
+    int n = 0, size = 0, i, ret;
+
+    if (encoded_size < 0)
+        return AVERROR(EINVAL);
+    if ((ret = fifo_get(s, &f)) < 0)
+        return ret;
+
+    /* samples per channel of the input: the ones the frames analysed since
+       the start of the stream read, whatever function encoded them, and
+       the ones kept */
+    done = (s->rs_out - f->start) / MPA_FRAME_SIZE;
+    nb_in = s->rs_out - f->start;
+    if (s->rs)
+        nb_in = resample_input_pos(s->rs, s->rs_out) - resample_input_pos(s->rs, f->start);
+    nb_in += f->nb_samples;
+
+    /* output samples of the input, then the frames which hold them all
+       once delayed by the filter bank */
+    nb_out = nb_in;
+    if (s->rs)
+        nb_out = (nb_in * s->rs->phases + s->rs->step - 1) / s->rs->step;
+    nb_frames = nb_out ? (nb_out + avctx->initial_padding + MPA_FRAME_SIZE - 1) / MPA_FRAME_SIZE : 0;
+    nb_frames = FFMAX(nb_frames, done);
+    if ((nb_frames - done + f->nb_pending) * MPA_encode_max_frame_size(avctx) > encoded_size)
+        return AVERROR(EINVAL);
+    if (end_padding)
+        *end_padding = (int)(nb_frames ? nb_frames * MPA_FRAME_SIZE - avctx->initial_padding - nb_out : 0);
+
+    for(;done<nb_frames;done++) {
+        fifo_write(s, NULL, 0, MPA_encode_input_size(avctx, 1) - f->nb_samples);
+        ret = fifo_encode(avctx, encoded + size, encoded_size - size, frame_sizes + n);
+        if (ret < 0)
+            return ret;
+        for(i=0;i<ret;i++)
+            size += frame_sizes[n++];
+    }
+    /* and the frames held back for the lookahead, which ends with them */
+    while (f->nb_pending) {
+        frame_sizes[n] = push_code(s, encoded + size);
+        size += frame_sizes[n++];
     }
+    f->nb_samples = 0;
+    f->start = s->rs_out;
+    return n;
+}
 
-    /* padding */
-    for(i=0;i<padding;i++)
-        put_bits(p, 1, 0);
+void MPA_encode_close(AVCodecContext *avctx)
+{
+    MpegAudioContext *s = avctx->priv_data;
 
-    /* flush */
-    flush_put_bits(p);
+    if (s->fifo) {
+        free(s->fifo->buf);
+        free(s->fifo->window);
+        free(s->fifo);
+        s->fifo = NULL;
+    }
 }
 
+#if ENCODE_STATS
+void MPA_encode_enable_stats(AVCodecContext *avctx, int enable)
+{
+    MpegAudioContext *s = avctx->priv_data;
 
-int MPA_encode_frame(AVCodecContext *avctx, int16_t* samples, uint8_t *encoded)
+    if (enable)
+        memset(&s->stats, 0, sizeof(s->stats));
+    s->stats_enabled = !!enable;
+}
+
+void MPA_encode_get_stats(AVCodecContext *avctx, MPAEncodeStats *stats)
 {
     MpegAudioContext *s = avctx->priv_data;
-    //const int16_t *samples = (const int16_t *)frame->data[0];
-    short smr[MPA_MAX_CHANNELS][SBLIMIT];
-    unsigned char bit_alloc[MPA_MAX_CHANNELS][SBLIMIT];
-    int padding, i;//, ret;
 
-    for(i=0;i<s->nb_channels;i++) {
-        filter(s, i, samples + i, s->nb_channels);
-    }
+    *stats = s->stats;
+}
 
-    for(i=0;i<s->nb_channels;i++) {
-        compute_scale_factors(s, s->scale_code[i], s->scale_factors[i],
-                              s->sb_samples[i], s->sblimit);
+static void add_stats(MPAEncodeStats *dst, const MPAEncodeStats *src)
+{
+    int i;
+
+    if (!src->frames)
+        return;
+    dst->frames += src->frames;
+    for(i=0;i<MPA_STAGE_NB;i++)
+        dst->stage_cycles[i] += src->stage_cycles[i];
+    dst->alloc_iterations += src->alloc_iterations;
+    dst->padding_bits += src->padding_bits;
+    dst->last_padding_bits = src->last_padding_bits;
+    dst->subbands_allocated += src->subbands_allocated;
+    for(i=0;i<4;i++)
+        dst->scale_code_hist[i] += src->scale_code_hist[i];
+}
+#endif
+
+void MPA_encode_resync(AVCodecContext *avctx, const int16_t *history, int64_t frame_number)
+{
+    MpegAudioContext *s = avctx->priv_data;
+    int ch, m;
+
+    /* the window of the next block covers its 32 new samples followed by
+       the 480 previous ones, most recent first */
+    for(ch=0;ch<s->nb_channels;ch++) {
+        for(m=0;m<SAMPLES_HIST_SIZE;m++)
+            s->chan[ch].samples_hist[m] = history ?
+                history[(SAMPLES_HIST_SIZE - 1 - m) * s->nb_channels + ch] : 0;
+        memset(s->chan[ch].rs_hist, 0, sizeof(s->chan[ch].rs_hist));
     }
-    for(i=0;i<s->nb_channels;i++) {
-        psycho_acoustic_model(s, smr[i]);
+    s->rs_out = frame_number * MPA_FRAME_SIZE;
+    if (s->fifo) {
+        /* the stream now starts frame_number frames before */
+        s->fifo->nb_samples = 0;
+        s->fifo->start = 0;
+        s->fifo->nb_pending = 0;
     }
-    compute_bit_allocation(s, smr, bit_alloc, &padding);
+#if FRAC_PADDING
+    s->frame_frac = (s->frame_frac +
+                     (uint64_t)frame_number % PADDING_FRAC * s->frame_frac_incr) % PADDING_FRAC;
+#endif
+}
 
-    //if ((ret = ff_alloc_packet2(avctx, avpkt, MPA_MAX_CODED_FRAME_SIZE, 0)) < 0)
-    //    return ret;
-    //avpkt->data = MPA_encoded;
-    //avpkt->size = sizeof(MPA_encoded);
+typedef struct EncodeChunk {
+    AVCodecContext avctx;
+    MpegAudioContext s;
+    const int16_t *samples;
+    int nb_frames;
+    uint8_t *encoded;
+    int encoded_size;
+    int *frame_sizes;
+    int *frame_offsets;
+    int ret;
+} EncodeChunk;
+
+#if HAVE_PTHREADS
+static void *encode_chunk(void *arg)
+{
+    EncodeChunk *c = arg;
 
-    init_put_bits(&s->pb, encoded, MPA_MAX_CODED_FRAME_SIZE);
+    c->ret = MPA_encode_frames(&c->avctx, c->samples, c->nb_frames,
+                               c->encoded, c->encoded_size,
+                               c->frame_sizes, c->frame_offsets);
+    return NULL;
+}
+#endif
 
-    encode_frame(s, bit_alloc, padding);
+int MPA_encode_frames_parallel(AVCodecContext *avctx, const int16_t *samples, int nb_frames,
+                               uint8_t *encoded, int encoded_size,
+                               int *frame_sizes, int *frame_offsets, int nb_threads)
+{
+    MpegAudioContext *s = avctx->priv_data;
+    int max_frame_bytes = MPA_encode_max_frame_size(avctx);
+    int frame_samples = MPA_FRAME_SIZE * s->nb_channels;
+    EncodeChunk *chunks;
+    int i, start, pos, ret;
 
-    //if (frame->pts != AV_NOPTS_VALUE)
-    //    avpkt->pts = frame->pts - ff_samples_to_time_base(avctx, avctx->initial_padding);
+    if (nb_frames < 0 || encoded_size < 0)
+        return AVERROR(EINVAL);
+    /* every chunk writes at its worst case offset, so only encode what is
+       sure to fit */
+    if (nb_frames > encoded_size / max_frame_bytes)
+        nb_frames = encoded_size / max_frame_bytes;
+    if (nb_threads > nb_frames)
+        nb_threads = nb_frames;
+    /* the chunks of a resampled stream do not start at known samples */
+    if (nb_threads <= 1 || !HAVE_PTHREADS || s->rs || s->do_downmix)
+        return MPA_encode_frames(avctx, samples, nb_frames, encoded, encoded_size,
+                                 frame_sizes, frame_offsets);
+
+    chunks = malloc(nb_threads * sizeof(*chunks));
+    if (!chunks)
+        return AVERROR(ENOMEM);
+
+    start = 0;
+    for(i=0;i<nb_threads;i++) {
+        EncodeChunk *c = &chunks[i];
+        c->nb_frames = (nb_frames - start) / (nb_threads - i);
+        /* s only has the channels it uses */
+        memcpy(&c->s, s, MPA_get_priv_data_size(s->nb_channels));
+#if ENCODE_STATS
+        memset(&c->s.stats, 0, sizeof(c->s.stats));
+#endif
+        c->avctx = *avctx;
+        c->avctx.priv_data = &c->s;
+        /* the push state stays the caller's */
+        c->s.fifo = NULL;
+        /* every chunk but the first one rebuilds the filter history from
+           the end of the previous chunk, and counts the frames of the
+           stream on from the previous calls */
+        if (i > 0) {
+            MPA_encode_resync(&c->avctx, samples + start * frame_samples - (512 - 32) * s->nb_channels,
+                              start);
+            c->s.rs_out = s->rs_out + (int64_t)start * MPA_FRAME_SIZE;
+        }
+        c->samples = samples + start * frame_samples;
+        c->encoded = encoded + start * max_frame_bytes;
+        c->encoded_size = c->nb_frames * max_frame_bytes;
+        c->frame_sizes = frame_sizes ? frame_sizes + start : NULL;
+        c->frame_offsets = frame_offsets ? frame_offsets + start : NULL;
+        start += c->nb_frames;
+    }
 
-    //avpkt->size = put_bits_count(&s->pb) / 8;
-    //*got_packet_ptr = 1;
-    return put_bits_count(&s->pb) / 8;
+#if HAVE_PTHREADS
+    {
+        pthread_t *threads = malloc(nb_threads * sizeof(*threads));
+        int nb_started = 0;
+
+        if (threads) {
+            /* the first chunk is encoded by the calling thread */
+            for(i=1;i<nb_threads;i++) {
+                if (pthread_create(&threads[i], NULL, encode_chunk, &chunks[i]))
+                    break;
+            }
+            nb_started = i;
+        }
+        encode_chunk(&chunks[0]);
+        for(i=1;i<nb_threads;i++) {
+            if (i < nb_started)
+                pthread_join(threads[i], NULL);
+            else
+                encode_chunk(&chunks[i]);
+        }
+        free(threads);
+    }
+#endif
+
+    /* the next call continues from the state of the last chunk */
+    {
+        struct MPAFifo *fifo = s->fifo;
+#if ENCODE_STATS
+        MPAEncodeStats stats = s->stats;
+        for(i=0;i<nb_threads;i++)
+            add_stats(&stats, &chunks[i].s.stats);
+#endif
+        memcpy(s, &chunks[nb_threads - 1].s, MPA_get_priv_data_size(s->nb_channels));
+        s->fifo = fifo;
+#if ENCODE_STATS
+        s->stats = stats;
+#endif
+    }
+
+    /* close the gaps left by unused padding slots */
+    pos = 0;
+    start = 0;
+    for(i=0;i<nb_threads;i++) {
+        EncodeChunk *c = &chunks[i];
+        int size = put_bits_count(&c->s.pb) / 8;
+
+        if (c->encoded != encoded + pos)
+            memmove(encoded + pos, c->encoded, size);
+        if (frame_offsets) {
+            int k;
+            for(k=0;k<c->nb_frames;k++)
+                frame_offsets[start + k] += pos;
+        }
+        pos += size;
+        start += c->nb_frames;
+    }
+    ret = nb_frames;
+    free(chunks);
+    return ret;
 }
 
 //static const AVCodecDefault mp2_defaults[] = {
@@ -1400,10 +4351,177 @@ const uint8_t pcm1k[96] = {
     0x86, 0xB1, 0x1C, 0xB8, 0xED, 0xBF, 0xD6, 0xC8, 0xB1, 0xD2, 0x53, 0xDD, 0x8C, 0xE8, 0x2C, 0xF4
 };
 
+#if HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* number of frames encoded per call, so that the frame sizes fit in a
+   small array */
+#define MAPPED_BLOCK_FRAMES 4096
+
+/*
+ * Encode straight from a mapping of the input file into a mapping of the
+ * output file. The output file is created with the size of the largest
+ * frames, and cut to the size of the encoded frames at the end. With
+ * several threads the whole frames are encoded in parallel, the rest is
+ * pushed as by the stdio path.
+ */
+static int encode_mapped(AVCodecContext* avctx, const char* infilename,
+                         const char* outfilename, int nb_threads)
+{
+    int sample_bytes = 2 * avctx->channels;
+    int frame_bytes = sample_bytes * MPA_FRAME_SIZE;
+    int max_frame_size = MPA_encode_max_frame_size(avctx);
+    int sizes[MAPPED_BLOCK_FRAMES], offsets[MAPPED_BLOCK_FRAMES];
+    int fdin, fdout, i, n, ret = -1;
+    struct stat st;
+    int64_t nb_samples = 0, nb_frames, frame = 0, sample, out_size = 0, pos = 0;
+    const uint8_t* in = MAP_FAILED;
+    uint8_t* out = MAP_FAILED;
+
+    fdin = open(infilename, O_RDONLY);
+    fdout = open(outfilename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fdin < 0 || fdout < 0 || fstat(fdin, &st) < 0) {
+        goto end;
+    }
+    nb_samples = st.st_size / sample_bytes;
+    nb_frames = nb_samples / MPA_FRAME_SIZE;
+    /* room for the whole frames, then for the flush */
+    out_size = (nb_frames + MPA_MAX_FLUSH_FRAMES) * max_frame_size;
+    if (!nb_samples) {
+        ret = 0;
+        goto end;
+    }
+    if (ftruncate(fdout, out_size) < 0) {
+        goto end;
+    }
+    in = mmap(NULL, nb_samples * sample_bytes, PROT_READ, MAP_PRIVATE, fdin, 0);
+    out = mmap(NULL, out_size, PROT_READ | PROT_WRITE, MAP_SHARED, fdout, 0);
+    if (in == MAP_FAILED || out == MAP_FAILED) {
+        goto end;
+    }
+    madvise((void*)in, nb_samples * sample_bytes, MADV_SEQUENTIAL);
+    madvise(out, out_size, MADV_SEQUENTIAL);
+
+    while (nb_threads > 1 && frame < nb_frames) {
+        n = (int)FFMIN(nb_frames - frame, MAPPED_BLOCK_FRAMES);
+        n = MPA_encode_frames_parallel(avctx, (const int16_t*)(in + frame * frame_bytes), n,
+                                       out + pos, n * max_frame_size,
+                                       sizes, offsets, nb_threads);
+        if (n <= 0) {
+            goto end;
+        }
+        pos += offsets[n - 1] + sizes[n - 1];
+        frame += n;
+    }
+    for (sample = frame * MPA_FRAME_SIZE; sample < nb_samples; ) {
+        const void* data[1] = { in + sample * sample_bytes };
+        int m = (int)FFMIN(nb_samples - sample, MAPPED_BLOCK_FRAMES * MPA_FRAME_SIZE);
+        n = MPA_encode_push(avctx, data, m, out + pos, (int)FFMIN(out_size - pos, INT_MAX), sizes);
+        if (n < 0) {
+            goto end;
+        }
+        for (i = 0; i < n; i++) {
+            pos += sizes[i];
+        }
+        sample += m;
+    }
+    /* the end of the input, and of the delay of the encoder */
+    n = MPA_encode_flush(avctx, out + pos, (int)FFMIN(out_size - pos, INT_MAX), sizes, NULL);
+    if (n < 0) {
+        goto end;
+    }
+    for (i = 0; i < n; i++) {
+        pos += sizes[i];
+    }
+    ret = 0;
+
+end:
+    MPA_encode_close(avctx);
+    if (in != MAP_FAILED) {
+        munmap((void*)in, nb_samples * sample_bytes);
+    }
+    if (out != MAP_FAILED) {
+        munmap(out, out_size);
+    }
+    /* unused padding slots, or the smaller frames of the variable modes */
+    if (!ret && pos != out_size && ftruncate(fdout, pos) < 0) {
+        ret = -1;
+    }
+    if (fdin >= 0) {
+        close(fdin);
+    }
+    if (fdout >= 0) {
+        close(fdout);
+    }
+    return ret;
+}
+#endif
+
+#include "mp2rtp.h"
+#if HAVE_SOCKETS
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* RTP packetiser to the IPv4 "address:port" dest, on a new socket */
+static MPARtp *open_rtp(const char *dest, int sample_rate, int *fd)
+{
+    MPARtpParams params = { 0 };
+    struct sockaddr_in addr = { 0 };
+    char host[64];
+    const char *port = strrchr(dest, ':');
+    MPARtp *rtp;
+
+    if (!port || port - dest >= (int)sizeof(host)) {
+        return NULL;
+    }
+    memcpy(host, dest, port - dest);
+    host[port - dest] = 0;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port + 1));
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        return NULL;
+    }
+    *fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (*fd < 0) {
+        return NULL;
+    }
+    params.sample_rate = sample_rate;
+    params.ssrc = (uint32_t)time(NULL);
+    rtp = MPA_rtp_create(*fd, (const struct sockaddr*)&addr, sizeof(addr), &params);
+    if (!rtp) {
+        close(*fd);
+    }
+    return rtp;
+}
+#endif
+
+/* frames back to back in buf, to the file or the RTP packetiser; n may
+   be the error of the encoder. Returns the first error. */
+static int write_frames(FILE* fp, MPARtp* rtp, const uint8_t* buf, const int* sizes, int n)
+{
+    int ret = n < 0 ? n : 0;
+
+    for (int i = 0; i < n && !ret; i++) {
+        if (rtp) {
+            ret = MPA_rtp_add_frame(rtp, buf, sizes[i]);
+        } else if (fwrite(buf, 1, sizes[i], fp) != (size_t)sizes[i]) {
+            ret = AVERROR(EIO);
+        }
+        buf += sizes[i];
+    }
+    return ret;
+}
+
 int main(int argc, void* argv[])
 {
     AVCodecContext mp2_ctx;
     MpegAudioContext mp2_priv_data;
+    memset(&mp2_ctx, 0, sizeof(mp2_ctx));
     mp2_ctx.priv_data = &mp2_priv_data;
     memset(&mp2_priv_data, 0, sizeof(mp2_priv_data));
 
@@ -1411,34 +4529,205 @@ int main(int argc, void* argv[])
     mp2_ctx.bit_rate = 192000;
     mp2_ctx.channels = 2;
 
-    MPA_encode_init(&mp2_ctx);
-
     char* infilename = "in.raw";
     char* outfilename = "out.mp3";
-
+    int nb_threads = 1;
+    int use_mmap = 0;
+    char* rtp_dest = NULL;
+
+    /* -j N: split the file into chunks encoded on N threads
+       -m: map the input and output files instead of reading and writing them
+       -p N: psycho acoustic model, see MPAPsyModel
+       -s N: stereo mode, MPA_STEREO or MPA_JSTEREO
+       -b N: bitrate in kb/s, the mean one with -r 2
+       -r N: rate control mode, see MPARateControl
+       -q N: noise to mask ratio in dB aimed at with -r 1
+       -k N: kernels, see MPAKernels
+       -f N: input sample format, see MPASampleFormat; planar input holds
+             the planes of each frame one after the other
+       -i N: sample rate of the input, resampled to the output one
+       -o N: sample rate of the output
+       -c N: channels of the input, mixed down with the default matrix
+       -u A:P: send the frames as RTP to the IPv4 address A, port P, instead
+               of writing them to the output file
+       -j and -m only apply to MPA_SAMPLE_FMT_S16 input at the output rate,
+       without a downmix */
+    while (argc >= 2) {
+        if (argc >= 3 && !strcmp(argv[1], "-j")) {
+            nb_threads = atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else if (argc >= 3 && !strcmp(argv[1], "-p")) {
+            mp2_ctx.psy_model = atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else if (argc >= 3 && !strcmp(argv[1], "-s")) {
+            mp2_ctx.stereo_mode = atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else if (argc >= 3 && !strcmp(argv[1], "-b")) {
+            mp2_ctx.bit_rate = atoi(argv[2]) * 1000;
+            argc -= 2;
+            argv += 2;
+        } else if (argc >= 3 && !strcmp(argv[1], "-r")) {
+            mp2_ctx.rc_mode = atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else if (argc >= 3 && !strcmp(argv[1], "-q")) {
+            mp2_ctx.vbr_quality = atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else if (argc >= 3 && !strcmp(argv[1], "-k")) {
+            mp2_ctx.kernels = atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else if (argc >= 3 && !strcmp(argv[1], "-f")) {
+            mp2_ctx.sample_fmt = atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else if (argc >= 3 && !strcmp(argv[1], "-i")) {
+            mp2_ctx.input_rate = atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else if (argc >= 3 && !strcmp(argv[1], "-o")) {
+            mp2_ctx.sample_rate = atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else if (argc >= 3 && !strcmp(argv[1], "-c")) {
+            mp2_ctx.input_channels = atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else if (argc >= 3 && !strcmp(argv[1], "-u")) {
+            rtp_dest = argv[2];
+            argc -= 2;
+            argv += 2;
+        } else if (!strcmp(argv[1], "-m")) {
+            use_mmap = 1;
+            argc--;
+            argv++;
+        } else {
+            break;
+        }
+    }
     if (argc >= 2) {
         infilename = argv[1];
         if (argc >= 3) {
             outfilename = argv[2];
         }
     }
+    if (MPA_encode_init(&mp2_ctx) < 0) {
+        return 1;
+    }
+
+    int in_channels = mp2_ctx.input_channels ? mp2_ctx.input_channels : mp2_ctx.channels;
+    int plain_input = mp2_ctx.sample_fmt == MPA_SAMPLE_FMT_S16 &&
+                      (!mp2_ctx.input_rate || mp2_ctx.input_rate == mp2_ctx.sample_rate) &&
+                      in_channels == mp2_ctx.channels && !rtp_dest;
+#if HAVE_MMAP
+    if (use_mmap && plain_input) {
+        return encode_mapped(&mp2_ctx, infilename, outfilename, nb_threads) < 0;
+    }
+#endif
 
-    FILE* fpin, *fpout;
+    FILE* fpin, *fpout = NULL;
+    MPARtp* rtp = NULL;
+    int rtp_fd = -1;
     fpin = fopen(infilename, "rb");
-    fpout = fopen(outfilename, "wb");
+    if (rtp_dest) {
+#if HAVE_SOCKETS
+        rtp = open_rtp(rtp_dest, mp2_ctx.sample_rate, &rtp_fd);
+#endif
+        if (!rtp) {
+            return 1;
+        }
+    } else {
+        fpout = fopen(outfilename, "wb");
+    }
+
+    if (nb_threads > 1 && plain_input) {
+        /* read the input by blocks of a few frames per thread; the encoder
+           keeps the filter state from one block to the next */
+        int nb_frames = 64 * nb_threads;
+        int16_t* inpcm = malloc((size_t)nb_frames * 1152 * 2 * mp2_ctx.channels);
+        uint8_t* encout = malloc((size_t)nb_frames * MPA_MAX_CODED_FRAME_SIZE);
+        int* sizes = malloc(nb_frames * sizeof(int));
+        int* offsets = malloc(nb_frames * sizeof(int));
+        int ret = 0;
+
+        while (!ret) {
+            int rdsize = fread(inpcm, 2 * mp2_ctx.channels, nb_frames * 1152, fpin);
+            int whole = rdsize / 1152;
+            if (whole > 0) {
+                int n = MPA_encode_frames_parallel(&mp2_ctx, inpcm, whole, encout,
+                                                   nb_frames * MPA_MAX_CODED_FRAME_SIZE,
+                                                   sizes, offsets, nb_threads);
+                if (n < 0) {
+                    ret = n;
+                } else if (n > 0 && fwrite(encout, 1, offsets[n - 1] + sizes[n - 1], fpout) !=
+                           (size_t)(offsets[n - 1] + sizes[n - 1])) {
+                    ret = AVERROR(EIO);
+                }
+            }
+            if (!ret && rdsize < nb_frames * 1152) {
+                /* the partial last frame and the delay of the encoder, as
+                   the stdio path */
+                const void* data[1] = { inpcm + whole * 1152 * mp2_ctx.channels };
+                int n = MPA_encode_push(&mp2_ctx, data, rdsize - whole * 1152, encout,
+                                        nb_frames * MPA_MAX_CODED_FRAME_SIZE, sizes);
+                ret = write_frames(fpout, NULL, encout, sizes, n);
+                if (!ret) {
+                    n = MPA_encode_flush(&mp2_ctx, encout, nb_frames * MPA_MAX_CODED_FRAME_SIZE,
+                                         sizes, NULL);
+                    ret = write_frames(fpout, NULL, encout, sizes, n);
+                }
+                break;
+            }
+        }
+        MPA_encode_close(&mp2_ctx);
+        free(inpcm);
+        free(encout);
+        free(sizes);
+        free(offsets);
+        fclose(fpin);
+        if (fclose(fpout) && !ret) {
+            ret = AVERROR(EIO);
+        }
+        if (ret < 0) {
+            fprintf(stderr, "%s: %s\n", outfilename, strerror(-ret));
+        }
+        return ret < 0;
+    }
 
     int frame = 0;
     int pcm1k_pos = 0;
-    for (;;) {
-        short inpcm[1152 * 2];
-        uint8_t encout[1024];
+    int sample_bytes = sample_fmt_bytes[mp2_ctx.sample_fmt];
+    int ret = 0;
+    while (!ret) {
+        /* room for all the input channels as floats at the highest input rate */
+        static float inpcm[(1152 * RS_MAX_RATIO + RS_MAX_TAPS) * MPA_MAX_INPUT_CHANNELS];
+        const void* data[MPA_MAX_INPUT_CHANNELS];
+        uint8_t encout[MPA_MAX_FLUSH_FRAMES * MPA_MAX_CODED_FRAME_SIZE];
+        int sizes[MPA_MAX_FLUSH_FRAMES];
+        /* 10 ms of interleaved input at a time, the streaming way; the planes
+           of planar input are a frame long */
+        int nb_samples = sample_fmt_planar[mp2_ctx.sample_fmt] ?
+                         MPA_encode_input_size(&mp2_ctx, 1) :
+                         (mp2_ctx.input_rate ? mp2_ctx.input_rate : mp2_ctx.sample_rate) / 100;
 
         frame++;
 #if 1
-        int rdsize = fread(inpcm, 2 * mp2_ctx.channels, 1152, fpin);
-        if (rdsize != 1152) {
+        int rdsize = fread(inpcm, sample_bytes * in_channels, nb_samples, fpin);
+        /* a short read of planar input is the last block, with shorter planes */
+        if (rdsize <= 0) {
+            /* the end of the input, and of the delay of the encoder */
+            int n = MPA_encode_flush(&mp2_ctx, encout, sizeof(encout), sizes, NULL);
+            ret = write_frames(fpout, rtp, encout, sizes, n);
             break;
         }
+        nb_samples = rdsize;
+        for (int ch = 0; ch < in_channels; ch++) {
+            data[ch] = (const uint8_t*)inpcm + ch * nb_samples * sample_bytes;
+        }
 #else
         if (frame > 100) break;
         for (int i = 0; i < 1152; i++) {
@@ -1448,13 +4737,27 @@ int main(int argc, void* argv[])
             }
         }
 #endif
-        int osize = MPA_encode_frame(&mp2_ctx, inpcm, encout);
-        fwrite(encout, 1, osize, fpout);
+        int n = MPA_encode_push(&mp2_ctx, data, nb_samples, encout, sizeof(encout), sizes);
+        ret = write_frames(fpout, rtp, encout, sizes, n);
     }
+    MPA_encode_close(&mp2_ctx);
 
     fclose(fpin);
-    fclose(fpout);
-    return 0;
+    if (rtp) {
+        if (!ret) {
+            ret = MPA_rtp_flush(rtp);
+        }
+        MPA_rtp_destroy(rtp);
+#if HAVE_SOCKETS
+        close(rtp_fd);
+#endif
+    } else if (fclose(fpout) && !ret) {
+        ret = AVERROR(EIO);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "%s: %s\n", rtp_dest ? rtp_dest : outfilename, strerror(-ret));
+    }
+    return ret < 0;
 }
 #endif
 
@@ -7,14 +7,30 @@
 
 //#define DEBUG_MP2
 
+/* per stream statistics, see MPAEncodeStats; 0 removes them */
+#ifndef ENCODE_STATS
+#define ENCODE_STATS 1
+#endif
+
 /* max frame size, in samples */
 #define MPA_FRAME_SIZE 1152
 
 /* max compressed frame size */
 #define MPA_MAX_CODED_FRAME_SIZE 1792
 
+/* max frames MPA_encode_flush() outputs: 2 for the delay of the filter
+   bank and, with MPA_RC_ABR, the 8 held back for the lookahead */
+#define MPA_MAX_FLUSH_FRAMES 10
+
 #define MPA_MAX_CHANNELS 2
 
+/* max input channels, mixed down to the encoded ones. Without a
+   downmix matrix the input is taken in WAVE order (front left, front
+   right, center, LFE, then pairs of left and right surrounds): the
+   center and surrounds are mixed in at -3 dB, the LFE is left out and
+   the gains are scaled down so that the mix cannot clip. */
+#define MPA_MAX_INPUT_CHANNELS 8
+
 #define SBLIMIT 32 /* number of subbands */
 
 #define MPA_STEREO  0
@@ -50,9 +66,15 @@ typedef int32_t MPA_INT;
 typedef int16_t OUT_INT;
 #endif
 
+#ifndef M_PI
+#define M_PI           3.14159265358979323846  /* pi */
+#endif
 #ifndef M_SQRT2
 #define M_SQRT2        1.41421356237309504880  /* sqrt(2) */
 #endif
+#ifndef M_SQRT1_2
+#define M_SQRT1_2      0.70710678118654752440  /* 1/sqrt(2) */
+#endif
 
 #ifdef __GNUC__
 #    define AV_GCC_VERSION_AT_LEAST(x,y) (__GNUC__ > (x) || __GNUC__ == (x) && __GNUC_MINOR__ >= (y))
@@ -86,6 +108,75 @@ typedef int16_t OUT_INT;
 #    define av_always_inline inline
 #endif
 #endif
+#if defined(__GNUC__) || defined(__clang__)
+#    define DECLARE_ALIGNED(n,t,v) t __attribute__ ((aligned (n))) v
+#elif defined(_MSC_VER)
+#    define DECLARE_ALIGNED(n,t,v) __declspec(align(n)) t v
+#else
+#    define DECLARE_ALIGNED(n,t,v) t v
+#endif
+
+/* SIMD kernels built, from the target flags; the AVX2 ones are built by
+   GCC and clang for any x86 target and only used if the CPU has AVX2.
+   Define any of these to 0 to leave the kernels out. */
+#ifndef HAVE_SSE2
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#    define HAVE_SSE2 1
+#else
+#    define HAVE_SSE2 0
+#endif
+#endif
+#ifndef HAVE_AVX2
+#if defined(__AVX2__) || ((AV_GCC_VERSION_AT_LEAST(4,9) || defined(__clang__)) && \
+                          (defined(__i386__) || defined(__x86_64__)))
+#    define HAVE_AVX2 1
+#else
+#    define HAVE_AVX2 0
+#endif
+#endif
+#ifndef HAVE_NEON
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#    define HAVE_NEON 1
+#else
+#    define HAVE_NEON 0
+#endif
+#endif
+
+#ifndef HAVE_FAST_CLZ
+#if AV_GCC_VERSION_AT_LEAST(3,4) || defined(__clang__)
+#    define HAVE_FAST_CLZ 1
+#else
+#    define HAVE_FAST_CLZ 0
+#endif
+#endif
+#ifndef HAVE_MMAP
+#if defined(_WIN32) && !defined(__CYGWIN__)
+#    define HAVE_MMAP 0
+#else
+#    define HAVE_MMAP 1
+#endif
+#endif
+#ifndef HAVE_SOCKETS
+#if defined(_WIN32) && !defined(__CYGWIN__)
+#    define HAVE_SOCKETS 0
+#else
+#    define HAVE_SOCKETS 1
+#endif
+#endif
+#ifndef HAVE_SENDMMSG
+#if defined(__linux__)
+#    define HAVE_SENDMMSG 1
+#else
+#    define HAVE_SENDMMSG 0
+#endif
+#endif
+#ifndef HAVE_PTHREADS
+#if defined(_WIN32) && !defined(__MINGW32__)
+#    define HAVE_PTHREADS 0
+#else
+#    define HAVE_PTHREADS 1
+#endif
+#endif
 
 #define AV_STRINGIFY(s)         AV_TOSTRING(s)
 #define AV_TOSTRING(s) #s
@@ -116,6 +207,19 @@ typedef int16_t OUT_INT;
     } while(0)
 #endif
 
+#ifndef AV_WB64
+#   define AV_WB64(p, val) do {                 \
+        uint64_t d = (val);                     \
+        ((uint8_t*)(p))[7] = (d);               \
+        ((uint8_t*)(p))[6] = (d)>>8;            \
+        ((uint8_t*)(p))[5] = (d)>>16;           \
+        ((uint8_t*)(p))[4] = (d)>>24;           \
+        ((uint8_t*)(p))[3] = (d)>>32;           \
+        ((uint8_t*)(p))[2] = (d)>>40;           \
+        ((uint8_t*)(p))[1] = (d)>>48;           \
+        ((uint8_t*)(p))[0] = (d)>>56;           \
+    } while(0)
+#endif
 
 #ifdef DEBUG_MP2
 #   define av_log(avcl, level, ...)	printf(__VA_ARGS__)
@@ -125,9 +229,69 @@ typedef int16_t OUT_INT;
 #   define ff_dlog(ctx, ...)        do {} while (0)
 #endif
 
+#define FFMAX(a,b) ((a) > (b) ? (a) : (b))
+#define FFMIN(a,b) ((a) > (b) ? (b) : (a))
+
+/**
+ * Clip a signed integer value into the -32768,32767 range.
+ */
+static av_always_inline int16_t av_clip_int16(int a)
+{
+    if ((a + 0x8000U) & ~0xFFFF) return (a >> 31) ^ 0x7FFF;
+    else                         return a;
+}
+
 #define AVERROR(e) (-(e))   ///< Returns a negative error code from a POSIX error code, to return from library functions.
 
 
+/**
+ * Psycho acoustic models, by decreasing cost.
+ */
+enum MPAPsyModel {
+    MPA_PSY_MODEL1,     ///< FFT based, after ISO 11172-3 model 1 (default)
+    MPA_PSY_SUBBAND,    ///< same masking from the subband energies, no FFT
+    MPA_PSY_FIXED,      ///< fixed signal to mask ratios, ignores the signal
+    MPA_PSY_NB
+};
+
+/**
+ * Implementations of the filter bank, DCT, scale factor and quantization
+ * kernels, which all give the same output. Only the ones built and
+ * supported by the CPU can be selected.
+ */
+enum MPAKernels {
+    MPA_KERNELS_AUTO,   ///< the fastest available, or MP2EN_KERNELS from the environment (default)
+    MPA_KERNELS_C,
+    MPA_KERNELS_SSE2,
+    MPA_KERNELS_AVX2,
+    MPA_KERNELS_NEON,
+    MPA_KERNELS_NB
+};
+
+/**
+ * Rate control modes. In the variable modes every frame has its own
+ * bitrate_index, among the bitrates Layer II allows for the channels.
+ */
+enum MPARateControl {
+    MPA_RC_CBR,         ///< constant bit_rate (default)
+    MPA_RC_VBR,         ///< smallest bitrate reaching vbr_quality in each frame
+    MPA_RC_ABR,         ///< variable, with bit_rate on average
+    MPA_RC_NB
+};
+
+/**
+ * Formats of the samples given to MPA_encode_frame_data() and
+ * MPA_encode_frames_data(). They are converted to 16 bits as the filter
+ * bank reads them.
+ */
+enum MPASampleFormat {
+    MPA_SAMPLE_FMT_S16,     ///< native endian 16 bit, interleaved (default)
+    MPA_SAMPLE_FMT_S16BE,   ///< big endian 16 bit, interleaved
+    MPA_SAMPLE_FMT_S24LE,   ///< packed 3 byte little endian, interleaved, truncated to 16 bits
+    MPA_SAMPLE_FMT_FLTP,    ///< float in [-1.0, 1.0], one plane per channel
+    MPA_SAMPLE_FMT_NB
+};
+
 typedef struct AVCodecContext {
     void* priv_data;
     /* audio only */
@@ -136,9 +300,214 @@ typedef struct AVCodecContext {
     int bit_rate;
     int frame_size;
     int initial_padding;
+    int psy_model;   ///< MPAPsyModel
+    int stereo_mode; ///< MPA_STEREO or MPA_JSTEREO, for 2 channels
+    int rc_mode;     ///< MPARateControl
+    int vbr_quality; ///< MPA_RC_VBR: noise to mask ratio aimed at, in dB, lower is better
+    int kernels;     ///< MPAKernels, set to the ones selected by MPA_encode_init()
+    int sample_fmt;  ///< MPASampleFormat of the _data() entry points
+    int input_rate;  ///< rate of the input samples, resampled to sample_rate; 0 for sample_rate
+    int input_channels; ///< channels of the input samples, mixed down to channels; 0 for channels
+    const float *downmix_matrix; ///< channels rows of input_channels gains, or NULL for the default
 } AVCodecContext;
 
 int ff_mpa_l2_select_table(int bitrate, int nb_channels, int freq, int lsf);
 
+/* Layer II tables, shared with the decoder */
+extern const uint16_t avpriv_mpa_bitrate_tab[2][3][15];
+extern const uint16_t avpriv_mpa_freq_tab[3];
+extern const int ff_mpa_sblimit_table[5];
+extern const int ff_mpa_quant_steps[17];
+extern const int ff_mpa_quant_bits[17];
+extern const unsigned char * const ff_mpa_alloc_tables[5];
+extern const int32_t ff_mpa_enwindow[257];
+
+/**
+ * Size of the encoder context to allocate for AVCodecContext.priv_data.
+ * It must be zeroed before MPA_encode_init().
+ */
+extern const int MPA_priv_data_size;
+
+/**
+ * Size of the encoder context for a stream of channels channels, which
+ * is enough instead of MPA_priv_data_size. The context only holds the
+ * state carried from frame to frame, about 1.4 kB per channel; the data
+ * of the frame being encoded is on the stack of the encoding calls.
+ *
+ * @return the size in bytes, or AVERROR(EINVAL)
+ */
+int MPA_get_priv_data_size(int channels);
+
+int MPA_encode_init(AVCodecContext *avctx);
+
+/**
+ * Encode one frame of MPA_FRAME_SIZE interleaved samples.
+ *
+ * @param encoded buffer of at least MPA_MAX_CODED_FRAME_SIZE bytes
+ * @return the size in bytes of the encoded frame
+ */
+int MPA_encode_frame(AVCodecContext *avctx, int16_t* samples, uint8_t *encoded);
+
+/**
+ * Encode one frame of MPA_FRAME_SIZE samples in the sample_fmt given to
+ * MPA_encode_init(): data[0] holds the interleaved samples, or data[ch]
+ * the plane of channel ch.
+ *
+ * @param encoded buffer of at least MPA_MAX_CODED_FRAME_SIZE bytes
+ * @return the size in bytes of the encoded frame
+ */
+int MPA_encode_frame_data(AVCodecContext *avctx, const void * const *data, uint8_t *encoded);
+
+/**
+ * Number of samples per channel the next nb_frames frames read:
+ * nb_frames * MPA_FRAME_SIZE, but with input_rate a number which varies
+ * from frame to frame and includes, in the first frame, the delay of
+ * the resampler. The frames of all the encoding functions are this
+ * size.
+ */
+int MPA_encode_input_size(AVCodecContext *avctx, int nb_frames);
+
+/**
+ * @return the largest size in bytes of an encoded frame of this stream
+ */
+int MPA_encode_max_frame_size(AVCodecContext *avctx);
+
+/**
+ * Encode nb_frames consecutive frames of MPA_FRAME_SIZE interleaved
+ * samples. The frames are written back to back into encoded.
+ * With MPA_RC_ABR the rate control looks ahead at the next frames of the
+ * batch, and only the frames sure to fit in encoded_size are encoded.
+ *
+ * @param encoded_size  size in bytes of the encoded buffer
+ * @param frame_sizes   if not NULL, receives the size in bytes of each frame
+ * @param frame_offsets if not NULL, receives the offset of each frame in encoded
+ * @return the number of frames encoded, which is less than nb_frames if
+ *         encoded is too small, or a negative error code
+ */
+int MPA_encode_frames(AVCodecContext *avctx, const int16_t *samples, int nb_frames,
+                      uint8_t *encoded, int encoded_size,
+                      int *frame_sizes, int *frame_offsets);
+
+/**
+ * MPA_encode_frames() of samples in sample_fmt, laid out as for
+ * MPA_encode_frame_data(). The planes hold
+ * MPA_encode_input_size(avctx, nb_frames) samples each.
+ */
+int MPA_encode_frames_data(AVCodecContext *avctx, const void * const *data, int nb_frames,
+                           uint8_t *encoded, int encoded_size,
+                           int *frame_sizes, int *frame_offsets);
+
+/**
+ * Number of frames MPA_encode_push() encodes for nb_samples more
+ * samples per channel, and so the most it outputs.
+ */
+int MPA_encode_push_frames(AVCodecContext *avctx, int nb_samples);
+
+/**
+ * Encode nb_samples samples per channel of any size, in sample_fmt and
+ * laid out as for MPA_encode_frame_data(). The whole frames are encoded
+ * from data and written back to back into encoded; the samples short of
+ * a frame are kept, at most a frame of them, until the next call
+ * completes it. With MPA_RC_ABR a frame is only output once the 8 frames
+ * after it have been pushed, so that the rate control looks as far ahead
+ * whatever the size of the calls. The context must not be given to the
+ * other encoding functions in between, but the stream may start with
+ * whole frames encoded by them, e.g. by MPA_encode_frames_parallel().
+ *
+ * @param encoded_size size in bytes of the encoded buffer, at least
+ *                     MPA_encode_push_frames(avctx, nb_samples) *
+ *                     MPA_encode_max_frame_size(avctx)
+ * @param frame_sizes  receives the size in bytes of each frame
+ * @return the number of frames encoded, or a negative error code
+ */
+int MPA_encode_push(AVCodecContext *avctx, const void * const *data, int nb_samples,
+                    uint8_t *encoded, int encoded_size, int *frame_sizes);
+
+/**
+ * Encode the samples kept by MPA_encode_push(), padded with silence, and
+ * the frames needed for the last samples to come out of the filter bank,
+ * at most 2 frames, then output the frames held back for the MPA_RC_ABR
+ * lookahead. The stream is the input since MPA_encode_init(),
+ * MPA_encode_resync() or the previous flush, whatever function encoded
+ * it. The decoded stream then starts with avctx->initial_padding samples
+ * of delay and ends with *end_padding samples of padding. The next
+ * MPA_encode_push() starts a new stream after the padding, with the same
+ * delay.
+ *
+ * @param encoded_size size in bytes of the encoded buffer, at least
+ *                     MPA_MAX_FLUSH_FRAMES * MPA_encode_max_frame_size(avctx)
+ * @param frame_sizes  receives the size in bytes of each frame
+ * @param end_padding  if not NULL, receives the samples of padding
+ * @return the number of frames encoded, or a negative error code
+ */
+int MPA_encode_flush(AVCodecContext *avctx, uint8_t *encoded, int encoded_size,
+                     int *frame_sizes, int *end_padding);
+
+/**
+ * Free what MPA_encode_push() allocated. The context itself is the
+ * caller's.
+ */
+void MPA_encode_close(AVCodecContext *avctx);
+
+#if ENCODE_STATS
+enum MPAEncodeStage {
+    MPA_STAGE_FILTER,   ///< polyphase filter bank, with the input conversion and resampling
+    MPA_STAGE_PSY,      ///< spectral analysis of the psycho acoustic model
+    MPA_STAGE_SCALE,    ///< scale factors and signal to mask ratios
+    MPA_STAGE_ALLOC,    ///< bit allocation
+    MPA_STAGE_ENCODE,   ///< quantization and bitstream writing
+    MPA_STAGE_NB
+};
+
+/**
+ * Counters accumulated over the frames encoded since the statistics were
+ * enabled or reset.
+ */
+typedef struct MPAEncodeStats {
+    uint64_t frames;
+    uint64_t stage_cycles[MPA_STAGE_NB];  ///< TSC ticks, or ns without a cycle counter
+    uint64_t alloc_iterations;            ///< steps of the bit allocation loop
+    uint64_t padding_bits;                ///< bits of the frames left unused
+    int last_padding_bits;                ///< unused bits of the last frame
+    uint64_t subbands_allocated;          ///< subbands with bits, over all channels
+    uint64_t scale_code_hist[4];          ///< transmission patterns of the allocated subbands
+} MPAEncodeStats;
+
+/**
+ * Enable or disable the statistics of a stream. Enabling them resets
+ * the counters. They are disabled by default.
+ */
+void MPA_encode_enable_stats(AVCodecContext *avctx, int enable);
+
+/**
+ * Copy the statistics of a stream to stats.
+ */
+void MPA_encode_get_stats(AVCodecContext *avctx, MPAEncodeStats *stats);
+#endif
+
+/**
+ * Set up the context to continue a stream at frame frame_number, as if
+ * all the previous frames had been encoded with it. Only the last
+ * 480 samples before the frame have an influence on the output.
+ *
+ * @param history the 480 interleaved samples preceding the frame, or NULL
+ *                for silence; with input_rate the resampler starts again
+ *                from silence whatever the history. With input_channels
+ *                the samples are the ones after the downmix.
+ * The samples kept by MPA_encode_push() are dropped.
+ */
+void MPA_encode_resync(AVCodecContext *avctx, const int16_t *history, int64_t frame_number);
+
+/**
+ * Same as MPA_encode_frames(), but the frames are split into nb_threads
+ * chunks which are encoded in parallel. The output is identical to the
+ * one of MPA_encode_frames(), except with MPA_RC_ABR where each chunk has
+ * its own rate control. With input_rate or a downmix the frames are
+ * encoded on the calling thread.
+ */
+int MPA_encode_frames_parallel(AVCodecContext *avctx, const int16_t *samples, int nb_frames,
+                               uint8_t *encoded, int encoded_size,
+                               int *frame_sizes, int *frame_offsets, int nb_threads);
+
 #endif
 
@@ -0,0 +1,178 @@
+/*
+ * Polyphase filter bank of the mpeg audio layer 2 encoder, for one
+ * instruction set
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Included by mp2en.c once per instruction set, with RENAME(), FUNC_ATTR,
+   IDCT_LANES, idct_vec, VLOAD(), VSTORE(), VADD(), VSUB(), VNEG() and
+   VMUL() defined, and RENAME(window_filter)() declared. */
+
+/* in: 32 coefficients of IDCT_LANES blocks, in[i * IDCT_LANES + block]
+   out: nb_blocks consecutive blocks of 32 samples */
+static FUNC_ATTR void RENAME(idct32_lanes)(int *out, const int *in, int nb_blocks)
+{
+    idct_vec t[32], x1, x2, x3, x4, xr;
+    int res[32 * IDCT_LANES];
+    const int *xp = costab32;
+    int i, j, k;
+
+    for(i=0;i<32;i++) t[i] = VLOAD(in + i * IDCT_LANES);
+
+    for(j=31;j>=3;j-=2) t[j] = VADD(t[j], t[j - 2]);
+
+    for(j=30;j!=2;j-=4) {
+        t[j]     = VADD(t[j],     t[j - 4]);
+        t[j + 1] = VADD(t[j + 1], t[j - 3]);
+    }
+
+    for(j=28;j!=4;j-=8) {
+        for(k=0;k<4;k++)
+            t[j + k] = VADD(t[j + k], t[j + k - 8]);
+    }
+
+    for(j=0;j<32;j+=16) {
+        t[j +  3] = VNEG(t[j +  3]);
+        t[j +  6] = VNEG(t[j +  6]);
+
+        t[j + 11] = VNEG(t[j + 11]);
+        t[j + 12] = VNEG(t[j + 12]);
+        t[j + 13] = VNEG(t[j + 13]);
+        t[j + 15] = VNEG(t[j + 15]);
+    }
+
+    for(j=0;j<8;j++) {
+        x3 = VMUL(t[j + 16], FIX(M_SQRT2*0.5));
+        x4 = VSUB(t[j], x3);
+        x3 = VADD(t[j], x3);
+
+        x2 = VMUL(VNEG(VADD(t[j + 24], t[j + 8])), FIX(M_SQRT2*0.5));
+        x1 = VMUL(VSUB(t[j + 8], x2), xp[0]);
+        x2 = VMUL(VADD(t[j + 8], x2), xp[1]);
+
+        t[j     ] = VADD(x3, x1);
+        t[j +  8] = VSUB(x4, x2);
+        t[j + 16] = VADD(x4, x2);
+        t[j + 24] = VSUB(x3, x1);
+    }
+
+    xp += 2;
+    for(j=0;j<4;j++) {
+        xr = VMUL(t[j + 28], xp[0]);
+        t[j + 28] = VSUB(t[j], xr);
+        t[j     ] = VADD(t[j], xr);
+
+        xr = VMUL(t[j + 4], xp[1]);
+        t[j +  4] = VSUB(t[j + 24], xr);
+        t[j + 24] = VADD(t[j + 24], xr);
+
+        xr = VMUL(t[j + 20], xp[2]);
+        t[j + 20] = VSUB(t[j + 8], xr);
+        t[j +  8] = VADD(t[j + 8], xr);
+
+        xr = VMUL(t[j + 12], xp[3]);
+        t[j + 12] = VSUB(t[j + 16], xr);
+        t[j + 16] = VADD(t[j + 16], xr);
+    }
+    xp += 4;
+
+    for (i = 0; i < 4; i++) {
+        xr = VMUL(t[30-i*4], xp[0]);
+        t[30-i*4] = VSUB(t[i*4], xr);
+        t[   i*4] = VADD(t[i*4], xr);
+
+        xr = VMUL(t[ 2+i*4], xp[1]);
+        t[ 2+i*4] = VSUB(t[28-i*4], xr);
+        t[28-i*4] = VADD(t[28-i*4], xr);
+
+        xr = VMUL(t[31-i*4], xp[0]);
+        t[31-i*4] = VSUB(t[1+i*4], xr);
+        t[ 1+i*4] = VADD(t[1+i*4], xr);
+
+        xr = VMUL(t[ 3+i*4], xp[1]);
+        t[ 3+i*4] = VSUB(t[29-i*4], xr);
+        t[29-i*4] = VADD(t[29-i*4], xr);
+
+        xp += 2;
+    }
+
+    for(j=30,k=1;j>=0;j-=2,k+=2) {
+        xr = VMUL(t[k], *xp);
+        t[k] = VSUB(t[j], xr);
+        t[j] = VADD(t[j], xr);
+        xp++;
+    }
+
+    for(i=0;i<32;i++) VSTORE(res + i * IDCT_LANES, t[i]);
+    for(j=0;j<nb_blocks;j++) {
+        for(i=0;i<32;i++)
+            out[i] = res[bitinv32[i] * IDCT_LANES + j];
+        out += 32;
+    }
+}
+
+static FUNC_ATTR void RENAME(filter)(MpegAudioContext *s, int ch, MPAInput *in)
+{
+    int offset, i, j;
+    int tmp[64];
+    int tmp1[32 * IDCT_LANES];
+    int lane = 0;
+    int *out;
+    short *buf;
+
+    offset = s->frame->samples_offset[ch];
+    out = &s->frame->sb_samples[ch][0][0][0];
+    for(j=0;j<36;j++) {
+        /* 32 samples at once */
+        buf = s->frame->samples_buf[ch] + offset;
+        input_block(s, in, buf, ch, j);
+        if (offset < 512 - 32)
+            memcpy(buf + SAMPLES_RING_SIZE, buf, 32 * sizeof(*buf));
+
+        /* filter */
+        RENAME(window_filter)(tmp, buf);
+        /* the blocks are transformed by groups of IDCT_LANES */
+        tmp1[lane] = tmp[16] >> WSHIFT;
+        for( i=1; i<=16; i++ ) tmp1[i * IDCT_LANES + lane] = (tmp[i+16]+tmp[16-i]) >> WSHIFT;
+        for( i=17; i<=31; i++ ) tmp1[i * IDCT_LANES + lane] = (tmp[i+16]-tmp[80-i]) >> WSHIFT;
+
+        if (++lane == IDCT_LANES || j == 35) {
+            RENAME(idct32_lanes)(out, tmp1, lane);
+            out += 32 * lane;
+            lane = 0;
+        }
+
+        /* advance of 32 samples */
+        offset -= 32;
+        /* handle the wrap around */
+        if (offset < 0)
+            offset += SAMPLES_RING_SIZE;
+    }
+    s->frame->samples_offset[ch] = offset;
+}
+
+#undef RENAME
+#undef FUNC_ATTR
+#undef IDCT_LANES
+#undef idct_vec
+#undef VLOAD
+#undef VSTORE
+#undef VADD
+#undef VSUB
+#undef VNEG
+#undef VMUL
@@ -0,0 +1,457 @@
+/*
+ * Multi-stream mpeg audio layer 2 encoding pool
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Encoding pool for many independent streams.
+ *
+ * A stream with queued frames is "ready" and sits in the run queue of
+ * exactly one worker, so its frames are always encoded in order by one
+ * thread at a time. A worker encodes at most POOL_QUANTUM frames of a
+ * stream before putting it back at the end of its queue, so that streams
+ * with a backlog cannot starve the others. Idle workers steal ready
+ * streams from the other queues.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mp2pool.h"
+
+#if HAVE_PTHREADS
+#include <pthread.h>
+
+/* frames encoded for a stream before it goes back to the end of the queue */
+#define POOL_QUANTUM 4
+
+#define POOL_PAGE_BITS 8
+#define POOL_PAGE_SIZE (1 << POOL_PAGE_BITS)
+#define POOL_MAX_PAGES 4096
+
+typedef struct MPAStream {
+    AVCodecContext avctx;
+    int index;
+    MPAPacketCallback callback;
+    void *opaque;
+
+    pthread_mutex_t lock;
+    int16_t *frames;        /* queue of max_queued_frames input frames */
+    int frame_samples;
+    int head, count;
+    int scheduled;          /* in a run queue or being encoded */
+    int home;               /* worker whose queue it is pushed to */
+} MPAStream;
+
+typedef struct RunQueue {
+    pthread_mutex_t lock;
+    MPAStream **streams;
+    int head, count, size;
+} RunQueue;
+
+typedef struct Worker {
+    MPAPool *pool;
+    int index;
+    pthread_t thread;
+    RunQueue queue;
+} Worker;
+
+struct MPAPool {
+    Worker *workers;
+    int nb_workers;
+    int nb_threads;             /* workers actually started */
+    int max_queued_frames;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;   /* signaled when a stream is queued */
+    pthread_cond_t idle_cond;   /* signaled when no frame is left */
+    int nb_queued;              /* streams in the run queues */
+    int nb_pending;             /* frames not encoded yet */
+    int quit;
+
+    MPAStream **pages[POOL_MAX_PAGES];
+    int nb_streams;
+};
+
+static int queue_push(RunQueue *q, MPAStream *st)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->size) {
+        int i, size = q->size ? 2 * q->size : 16;
+        MPAStream **streams = malloc(size * sizeof(*streams));
+
+        if (!streams) {
+            pthread_mutex_unlock(&q->lock);
+            return AVERROR(ENOMEM);
+        }
+        for(i=0;i<q->count;i++)
+            streams[i] = q->streams[(q->head + i) % q->size];
+        free(q->streams);
+        q->streams = streams;
+        q->head = 0;
+        q->size = size;
+    }
+    q->streams[(q->head + q->count) % q->size] = st;
+    q->count++;
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+static MPAStream *queue_pop(RunQueue *q)
+{
+    MPAStream *st = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count) {
+        st = q->streams[q->head];
+        q->head = (q->head + 1) % q->size;
+        q->count--;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return st;
+}
+
+static int schedule(MPAPool *pool, MPAStream *st, int worker)
+{
+    int ret = queue_push(&pool->workers[worker].queue, st);
+
+    if (ret < 0)
+        return ret;
+    pthread_mutex_lock(&pool->lock);
+    pool->nb_queued++;
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+static MPAStream *find_work(Worker *w)
+{
+    MPAPool *pool = w->pool;
+    MPAStream *st;
+    int i;
+
+    /* own queue first, then steal from the others */
+    st = queue_pop(&w->queue);
+    for(i=1;!st && i<pool->nb_workers;i++)
+        st = queue_pop(&pool->workers[(w->index + i) % pool->nb_workers].queue);
+    if (st) {
+        pthread_mutex_lock(&pool->lock);
+        pool->nb_queued--;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return st;
+}
+
+static void run_stream(Worker *w, MPAStream *st)
+{
+    MPAPool *pool = w->pool;
+    uint8_t encoded[MPA_MAX_CODED_FRAME_SIZE];
+    int n, size, more;
+
+    for(;;) {
+        for(n=0;n<POOL_QUANTUM;n++) {
+            int16_t *samples;
+
+            pthread_mutex_lock(&st->lock);
+            if (!st->count) {
+                st->scheduled = 0;
+                pthread_mutex_unlock(&st->lock);
+                return;
+            }
+            samples = st->frames + st->head * st->frame_samples;
+            pthread_mutex_unlock(&st->lock);
+
+            /* the slot stays counted until it is encoded, so submit cannot
+               overwrite it */
+            size = MPA_encode_frame(&st->avctx, samples, encoded);
+            st->callback(st->opaque, st->index, encoded, size);
+
+            pthread_mutex_lock(&st->lock);
+            st->head = (st->head + 1) % pool->max_queued_frames;
+            st->count--;
+            pthread_mutex_unlock(&st->lock);
+
+            pthread_mutex_lock(&pool->lock);
+            if (!--pool->nb_pending)
+                pthread_cond_broadcast(&pool->idle_cond);
+            pthread_mutex_unlock(&pool->lock);
+        }
+
+        pthread_mutex_lock(&st->lock);
+        more = st->count > 0;
+        if (!more)
+            st->scheduled = 0;
+        pthread_mutex_unlock(&st->lock);
+        /* requeue at the end of our own queue to let the other streams run;
+           if that fails the stream stays ours, its frames are still pending */
+        if (!more || schedule(pool, st, w->index) >= 0)
+            return;
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    Worker *w = arg;
+    MPAPool *pool = w->pool;
+    MPAStream *st;
+
+    for(;;) {
+        st = find_work(w);
+        if (st) {
+            run_stream(w, st);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->nb_queued && !pool->quit)
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        if (pool->quit) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+static MPAStream *get_stream(MPAPool *pool, int index)
+{
+    MPAStream *st = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (index >= 0 && index < pool->nb_streams)
+        st = pool->pages[index >> POOL_PAGE_BITS][index & (POOL_PAGE_SIZE - 1)];
+    pthread_mutex_unlock(&pool->lock);
+    return st;
+}
+
+MPAPool *MPA_pool_create(int nb_workers, int max_queued_frames)
+{
+    MPAPool *pool;
+    int i;
+
+    if (nb_workers <= 0 || max_queued_frames <= 0)
+        return NULL;
+    pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+    pool->workers = calloc(nb_workers, sizeof(*pool->workers));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    pool->max_queued_frames = max_queued_frames;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    for(i=0;i<nb_workers;i++) {
+        Worker *w = &pool->workers[i];
+        w->pool = pool;
+        w->index = i;
+        pthread_mutex_init(&w->queue.lock, NULL);
+    }
+    /* nb_workers is only set once all the queues exist, as the workers
+       steal from each other */
+    pool->nb_workers = nb_workers;
+    for(i=0;i<nb_workers;i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_thread, &pool->workers[i])) {
+            MPA_pool_destroy(pool);
+            return NULL;
+        }
+        pool->nb_threads++;
+    }
+    return pool;
+}
+
+int MPA_pool_add_stream(MPAPool *pool, int sample_rate, int channels, int bit_rate,
+                        MPAPacketCallback callback, void *opaque)
+{
+    MPAStream *st;
+    int ret, index, size;
+
+    /* the context is sized for the channels of the stream */
+    size = MPA_get_priv_data_size(channels);
+    if (size < 0)
+        return size;
+    st = calloc(1, sizeof(*st));
+    if (!st)
+        return AVERROR(ENOMEM);
+    st->avctx.priv_data = calloc(1, size);
+    if (!st->avctx.priv_data) {
+        free(st);
+        return AVERROR(ENOMEM);
+    }
+    st->avctx.sample_rate = sample_rate;
+    st->avctx.channels = channels;
+    st->avctx.bit_rate = bit_rate;
+    ret = MPA_encode_init(&st->avctx);
+    if (ret < 0)
+        goto fail;
+    st->frame_samples = MPA_FRAME_SIZE * channels;
+    st->frames = malloc((size_t)pool->max_queued_frames * st->frame_samples * sizeof(*st->frames));
+    if (!st->frames) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    st->callback = callback;
+    st->opaque = opaque;
+    pthread_mutex_init(&st->lock, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    index = pool->nb_streams;
+    if (index >= POOL_MAX_PAGES * POOL_PAGE_SIZE) {
+        pthread_mutex_unlock(&pool->lock);
+        pthread_mutex_destroy(&st->lock);
+        ret = AVERROR(ENOSPC);
+        goto fail;
+    }
+    if (!pool->pages[index >> POOL_PAGE_BITS]) {
+        pool->pages[index >> POOL_PAGE_BITS] = calloc(POOL_PAGE_SIZE, sizeof(MPAStream *));
+        if (!pool->pages[index >> POOL_PAGE_BITS]) {
+            pthread_mutex_unlock(&pool->lock);
+            pthread_mutex_destroy(&st->lock);
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+    }
+    st->index = index;
+    st->home = index % pool->nb_workers;
+    pool->pages[index >> POOL_PAGE_BITS][index & (POOL_PAGE_SIZE - 1)] = st;
+    pool->nb_streams++;
+    pthread_mutex_unlock(&pool->lock);
+    return index;
+
+fail:
+    free(st->frames);
+    free(st->avctx.priv_data);
+    free(st);
+    return ret;
+}
+
+int MPA_pool_submit(MPAPool *pool, int stream_index, const int16_t *samples)
+{
+    MPAStream *st = get_stream(pool, stream_index);
+    int start, ret = 0;
+
+    if (!st)
+        return AVERROR(EINVAL);
+
+    pthread_mutex_lock(&st->lock);
+    if (st->count == pool->max_queued_frames) {
+        pthread_mutex_unlock(&st->lock);
+        return AVERROR(EAGAIN);
+    }
+    memcpy(st->frames + (st->head + st->count) % pool->max_queued_frames * st->frame_samples,
+           samples, st->frame_samples * sizeof(*samples));
+    st->count++;
+    start = !st->scheduled;
+    st->scheduled = 1;
+    pthread_mutex_unlock(&st->lock);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->nb_pending++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (start) {
+        ret = schedule(pool, st, st->home);
+        if (ret < 0) {
+            /* no worker owns the stream, so take the frame back: it is
+               either queued or rejected */
+            pthread_mutex_lock(&st->lock);
+            st->count--;
+            st->scheduled = 0;
+            pthread_mutex_unlock(&st->lock);
+
+            pthread_mutex_lock(&pool->lock);
+            if (!--pool->nb_pending)
+                pthread_cond_broadcast(&pool->idle_cond);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    return ret;
+}
+
+void MPA_pool_drain(MPAPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->nb_pending)
+        pthread_cond_wait(&pool->idle_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void MPA_pool_destroy(MPAPool *pool)
+{
+    int i;
+
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for(i=0;i<pool->nb_threads;i++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    for(i=0;i<pool->nb_streams;i++) {
+        MPAStream *st = pool->pages[i >> POOL_PAGE_BITS][i & (POOL_PAGE_SIZE - 1)];
+        pthread_mutex_destroy(&st->lock);
+        free(st->frames);
+        free(st->avctx.priv_data);
+        free(st);
+    }
+    for(i=0;i<POOL_MAX_PAGES;i++)
+        free(pool->pages[i]);
+    for(i=0;i<pool->nb_workers;i++) {
+        pthread_mutex_destroy(&pool->workers[i].queue.lock);
+        free(pool->workers[i].queue.streams);
+    }
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+#else /* !HAVE_PTHREADS */
+
+MPAPool *MPA_pool_create(int nb_workers, int max_queued_frames)
+{
+    return NULL;
+}
+
+int MPA_pool_add_stream(MPAPool *pool, int sample_rate, int channels, int bit_rate,
+                        MPAPacketCallback callback, void *opaque)
+{
+    return AVERROR(ENOSYS);
+}
+
+int MPA_pool_submit(MPAPool *pool, int stream_index, const int16_t *samples)
+{
+    return AVERROR(ENOSYS);
+}
+
+void MPA_pool_drain(MPAPool *pool)
+{
+}
+
+void MPA_pool_destroy(MPAPool *pool)
+{
+}
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * Multi-stream mpeg audio layer 2 encoding pool
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MP2POOL_H
+#define MP2POOL_H
+
+#include "mp2en.h"
+
+typedef struct MPAPool MPAPool;
+
+/**
+ * Called from a worker thread for each encoded frame. The calls for a
+ * given stream are never concurrent and come in frame order.
+ */
+typedef void (*MPAPacketCallback)(void *opaque, int stream_index,
+                                  const uint8_t *data, int size);
+
+/**
+ * Create a pool of nb_workers encoding threads.
+ *
+ * @param max_queued_frames number of input frames each stream can buffer
+ * @return the pool, or NULL on failure
+ */
+MPAPool *MPA_pool_create(int nb_workers, int max_queued_frames);
+
+/**
+ * Add a stream to the pool. It is safe to call while other streams are
+ * being encoded.
+ *
+ * @return the stream index, or a negative error code
+ */
+int MPA_pool_add_stream(MPAPool *pool, int sample_rate, int channels, int bit_rate,
+                        MPAPacketCallback callback, void *opaque);
+
+/**
+ * Queue one frame of MPA_FRAME_SIZE interleaved samples for a stream.
+ * The samples are copied.
+ *
+ * @return 0 on success, AVERROR(EAGAIN) if the queue of the stream is full,
+ *         or another negative error code; the frame is only queued on success
+ */
+int MPA_pool_submit(MPAPool *pool, int stream_index, const int16_t *samples);
+
+/**
+ * Wait until all the queued frames have been encoded.
+ */
+void MPA_pool_drain(MPAPool *pool);
+
+/**
+ * Stop the workers and free the pool. The workers first encode the frames
+ * still queued and run their callbacks, as MPA_pool_drain() would, so no
+ * frame may be submitted meanwhile.
+ */
+void MPA_pool_destroy(MPAPool *pool);
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * RTP packetisation of mpeg audio layer 2 frames (RFC 2250)
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * RTP packetiser for the encoded frames.
+ *
+ * Each packet is the 12 byte RTP header, the 4 byte MPEG audio header of
+ * RFC 2250 (16 bits of zero and the offset of the fragment) and either
+ * whole frames or a fragment of one frame. The timestamp is the one of
+ * the first frame of the packet, on the 90 kHz clock. The packets are
+ * built in place in a buffer of batch_size packets, which is sent with
+ * one sendmmsg() call once full.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* sendmmsg() */
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#include "mp2rtp.h"
+
+#if HAVE_SOCKETS
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define RTP_HEADER_SIZE 12
+#define MPA_HEADER_SIZE 4
+#define RTP_DEFAULT_PACKET_SIZE 1400
+#define RTP_DEFAULT_BATCH_SIZE  16
+#define RTP_PT_MPA 14
+
+struct MPARtp {
+    int fd;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;              /* 0 for a connected socket */
+
+    int sample_rate;
+    int max_packet_size;
+    int max_frames;
+    int batch_size;
+    int payload_type;
+    uint32_t ssrc;
+    uint16_t seq;
+    uint32_t first_timestamp;
+    int64_t nb_samples;             /* of the frames added so far */
+    int marker;                     /* set on the first packet */
+
+    uint8_t *buf;                   /* batch_size packets of max_packet_size bytes */
+    int *sizes;
+    int nb_packets;                 /* complete packets, waiting for a full batch */
+    int nb_frames;                  /* whole frames in packet nb_packets */
+#if HAVE_SENDMMSG
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+#endif
+};
+
+MPARtp *MPA_rtp_create(int fd, const struct sockaddr *addr, int addrlen,
+                       const MPARtpParams *params)
+{
+    MPARtp *rtp;
+
+    if (fd < 0 || params->sample_rate <= 0 || params->max_frames < 0 ||
+        params->batch_size < 0 || params->payload_type < 0 || params->payload_type > 127 ||
+        (addr && (addrlen <= 0 || addrlen > (int)sizeof(rtp->addr))))
+        return NULL;
+    if (params->max_packet_size &&
+        params->max_packet_size <= RTP_HEADER_SIZE + MPA_HEADER_SIZE)
+        return NULL;
+    rtp = calloc(1, sizeof(*rtp));
+    if (!rtp)
+        return NULL;
+    rtp->fd = fd;
+    if (addr) {
+        memcpy(&rtp->addr, addr, addrlen);
+        rtp->addrlen = addrlen;
+    }
+    rtp->sample_rate = params->sample_rate;
+    rtp->max_packet_size = params->max_packet_size ? params->max_packet_size : RTP_DEFAULT_PACKET_SIZE;
+    rtp->max_frames = params->max_frames ? params->max_frames : INT_MAX;
+    rtp->batch_size = params->batch_size ? params->batch_size : RTP_DEFAULT_BATCH_SIZE;
+    rtp->payload_type = params->payload_type ? params->payload_type : RTP_PT_MPA;
+    rtp->ssrc = params->ssrc;
+    rtp->seq = params->first_seq;
+    rtp->first_timestamp = params->first_timestamp;
+    rtp->marker = 1;
+
+    rtp->buf = malloc((size_t)rtp->batch_size * rtp->max_packet_size);
+    rtp->sizes = calloc(rtp->batch_size, sizeof(*rtp->sizes));
+#if HAVE_SENDMMSG
+    rtp->msgs = calloc(rtp->batch_size, sizeof(*rtp->msgs));
+    rtp->iov = calloc(rtp->batch_size, sizeof(*rtp->iov));
+    if (!rtp->msgs || !rtp->iov) {
+        MPA_rtp_destroy(rtp);
+        return NULL;
+    }
+#endif
+    if (!rtp->buf || !rtp->sizes) {
+        MPA_rtp_destroy(rtp);
+        return NULL;
+    }
+    return rtp;
+}
+
+static int rtp_send(MPARtp *rtp)
+{
+    int i, n = rtp->nb_packets, ret = 0;
+
+    rtp->nb_packets = 0;
+#if HAVE_SENDMMSG
+    for(i=0;i<n;i++) {
+        rtp->iov[i].iov_base = rtp->buf + (size_t)i * rtp->max_packet_size;
+        rtp->iov[i].iov_len = rtp->sizes[i];
+        memset(&rtp->msgs[i].msg_hdr, 0, sizeof(rtp->msgs[i].msg_hdr));
+        rtp->msgs[i].msg_hdr.msg_name = rtp->addrlen ? &rtp->addr : NULL;
+        rtp->msgs[i].msg_hdr.msg_namelen = rtp->addrlen;
+        rtp->msgs[i].msg_hdr.msg_iov = &rtp->iov[i];
+        rtp->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    /* sendmmsg() can stop short, e.g. on a signal */
+    for(i=0;i<n;) {
+        int sent = sendmmsg(rtp->fd, rtp->msgs + i, n - i, 0);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = AVERROR(errno);
+            break;
+        }
+        i += sent;
+    }
+#else
+    for(i=0;i<n;i++) {
+        if (sendto(rtp->fd, (const char *)rtp->buf + (size_t)i * rtp->max_packet_size,
+                   rtp->sizes[i], 0, rtp->addrlen ? (const struct sockaddr *)&rtp->addr : NULL,
+                   rtp->addrlen) < 0) {
+            if (errno == EINTR) {
+                i--;
+                continue;
+            }
+            ret = AVERROR(errno);
+            break;
+        }
+    }
+#endif
+    return ret;
+}
+
+/* start packet nb_packets with the headers of the frame being added */
+static void rtp_begin_packet(MPARtp *rtp, int frag_offset)
+{
+    uint8_t *p = rtp->buf + (size_t)rtp->nb_packets * rtp->max_packet_size;
+    uint32_t timestamp = rtp->first_timestamp +
+                         (uint32_t)(rtp->nb_samples * 90000 / rtp->sample_rate);
+
+    p[0] = 0x80;                                    /* version 2 */
+    p[1] = (rtp->marker << 7) | rtp->payload_type;
+    p[2] = rtp->seq >> 8;
+    p[3] = rtp->seq;
+    AV_WB32(p + 4, timestamp);
+    AV_WB32(p + 8, rtp->ssrc);
+    AV_WB32(p + 12, frag_offset);                   /* MBZ and Frag_offset */
+    rtp->sizes[rtp->nb_packets] = RTP_HEADER_SIZE + MPA_HEADER_SIZE;
+    rtp->marker = 0;
+    rtp->seq++;
+}
+
+static int rtp_end_packet(MPARtp *rtp)
+{
+    rtp->nb_frames = 0;
+    if (++rtp->nb_packets == rtp->batch_size)
+        return rtp_send(rtp);
+    return 0;
+}
+
+int MPA_rtp_add_frame(MPARtp *rtp, const uint8_t *frame, int size)
+{
+    int payload_size = rtp->max_packet_size - RTP_HEADER_SIZE - MPA_HEADER_SIZE;
+    int ret = 0, pos, n;
+
+    if (size <= 0)
+        return AVERROR(EINVAL);
+    /* close the packet if the frame does not fit in it */
+    if (rtp->nb_frames &&
+        (rtp->sizes[rtp->nb_packets] + size > rtp->max_packet_size || size > payload_size)) {
+        ret = rtp_end_packet(rtp);
+    }
+
+    if (size > payload_size) {
+        /* the fragments of the frame, each in its own packet */
+        for(pos=0;pos<size;pos+=n) {
+            int err;
+            n = FFMIN(size - pos, payload_size);
+            rtp_begin_packet(rtp, pos);
+            memcpy(rtp->buf + (size_t)rtp->nb_packets * rtp->max_packet_size +
+                   rtp->sizes[rtp->nb_packets], frame + pos, n);
+            rtp->sizes[rtp->nb_packets] += n;
+            if ((err = rtp_end_packet(rtp)) < 0)
+                ret = err;
+        }
+    } else {
+        if (!rtp->nb_frames)
+            rtp_begin_packet(rtp, 0);
+        memcpy(rtp->buf + (size_t)rtp->nb_packets * rtp->max_packet_size +
+               rtp->sizes[rtp->nb_packets], frame, size);
+        rtp->sizes[rtp->nb_packets] += size;
+        if (++rtp->nb_frames == rtp->max_frames) {
+            int err = rtp_end_packet(rtp);
+            if (err < 0)
+                ret = err;
+        }
+    }
+    rtp->nb_samples += MPA_FRAME_SIZE;
+    return ret;
+}
+
+int MPA_rtp_flush(MPARtp *rtp)
+{
+    if (rtp->nb_frames) {
+        rtp->nb_frames = 0;
+        rtp->nb_packets++;
+    }
+    return rtp->nb_packets ? rtp_send(rtp) : 0;
+}
+
+void MPA_rtp_destroy(MPARtp *rtp)
+{
+    if (!rtp)
+        return;
+    free(rtp->buf);
+    free(rtp->sizes);
+#if HAVE_SENDMMSG
+    free(rtp->msgs);
+    free(rtp->iov);
+#endif
+    free(rtp);
+}
+
+#else /* !HAVE_SOCKETS */
+
+MPARtp *MPA_rtp_create(int fd, const struct sockaddr *addr, int addrlen,
+                       const MPARtpParams *params)
+{
+    return NULL;
+}
+
+int MPA_rtp_add_frame(MPARtp *rtp, const uint8_t *frame, int size)
+{
+    return AVERROR(ENOSYS);
+}
+
+int MPA_rtp_flush(MPARtp *rtp)
+{
+    return AVERROR(ENOSYS);
+}
+
+void MPA_rtp_destroy(MPARtp *rtp)
+{
+}
+
+#endif
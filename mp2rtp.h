@@ -0,0 +1,76 @@
+/*
+ * RTP packetisation of mpeg audio layer 2 frames (RFC 2250)
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MP2RTP_H
+#define MP2RTP_H
+
+#include "mp2en.h"
+
+struct sockaddr;
+
+typedef struct MPARtp MPARtp;
+
+/**
+ * Parameters of an RTP stream, 0 for the defaults.
+ */
+typedef struct MPARtpParams {
+    int sample_rate;        ///< of the frames, for the timestamps
+    int max_packet_size;    ///< UDP payload, with the headers; 1400 by default
+    int max_frames;         ///< frames aggregated in a packet, as many as fit by default
+    int batch_size;         ///< packets sent per system call, 16 by default
+    int payload_type;       ///< 14 (MPA) by default
+    uint32_t ssrc;
+    uint16_t first_seq;     ///< sequence number of the first packet
+    uint32_t first_timestamp; ///< timestamp of the first frame, on the 90 kHz clock
+} MPARtpParams;
+
+/**
+ * Create a packetiser sending to addr through the UDP socket fd, or to the
+ * address fd is connected to if addr is NULL. The socket is the caller's.
+ *
+ * @return the packetiser, or NULL on failure
+ */
+MPARtp *MPA_rtp_create(int fd, const struct sockaddr *addr, int addrlen,
+                       const MPARtpParams *params);
+
+/**
+ * Add an encoded frame to the stream. Whole frames are aggregated into a
+ * packet up to max_frames or max_packet_size, a frame too big for a
+ * packet is fragmented. The packets are sent batch_size at a time.
+ *
+ * @return 0 on success, or the negative error of the send, in which
+ *         case the packets of the batch not sent are lost
+ */
+int MPA_rtp_add_frame(MPARtp *rtp, const uint8_t *frame, int size);
+
+/**
+ * Send the packet being filled and those waiting for a full batch, e.g.
+ * at the end of the stream or to bound the latency.
+ *
+ * @return 0 on success, or a negative error code
+ */
+int MPA_rtp_flush(MPARtp *rtp);
+
+/**
+ * Free the packetiser, without sending what is queued.
+ */
+void MPA_rtp_destroy(MPARtp *rtp);
+
+#endif